@@ -5,6 +5,7 @@
 
 #include "adi.h"
 #include "swd.h"
+#include "breakpoint.h"
 
 //
 // Debug Port Register Addresses
@@ -67,6 +68,11 @@ struct memcache {
     uint32_t addr;
     uint32_t value;
 };
+struct watch {
+    uint32_t addr;
+    uint32_t size;
+    int type;                   // WP_xxx, or zero if unused
+};
 
 enum {
     STATE_UNKNOWN,
@@ -83,6 +89,10 @@ struct core {
     uint32_t            ap_mem_csw_cache;
 
     uint32_t            breakpoints[4];
+    uint8_t             bp_refs[4];         // how many users of each slot (GDB, sw flash, trace)
+    struct watch        watchpoints[2];
+    uint32_t            watch_hit;          // address of the last watchpoint hit
+    int                 watch_hit_type;
     struct reg          reg_cache[24];
 };
 
@@ -141,6 +151,14 @@ static inline void mem_cache_invalidate() {
     mem_cache_valid = 0;
 }
 
+/**
+ * @brief Invalidate the memory cache from outside (needed when a core is left
+ *        running in non-stop mode and memory can change under us)
+ */
+void mem_flush_cache() {
+    mem_cache_invalidate();
+}
+
 // ----------------------------------------------------------------------------
 // Slightly Higher Level Functions
 // ----------------------------------------------------------------------------
@@ -477,6 +495,8 @@ int mem_write_block(uint32_t addr, uint32_t count, uint8_t *src) {
         } else {
             CHECK_OK(mem_write_block_unaligned(addr, (count & ~3), src));
         }
+        src += count & ~3;
+        addr += count & ~3;
         count = count & 3;
         if (!count) return SWD_OK;
     }
@@ -552,10 +572,10 @@ int mem_read_block(uint32_t addr, uint32_t count, uint8_t *dest) {
     if (addr & 3) {
         CHECK_OK(mem_read32(addr & 0xffffffffc, &v32));
 
-        switch (addr&3) {
-            case 1:     *dest++ = (v32 & 0xff00) >> 8; addr++;
-            case 2:     *dest++ = (v32 & 0xff0000) >> 16; addr++;
-            case 3:     *dest++ = v32 >> 24; addr++;
+        while ((addr & 3) && count) {
+            *dest++ = v32 >> ((addr & 3) << 3);
+            addr++;
+            count--;
         }
     }
 
@@ -684,24 +704,60 @@ static inline int bp_find(uint32_t addr) {
     return -1;
 }
 
+/**
+ * @brief Is there a hardware breakpoint at addr, returns how many users it has
+ *        (so zero if not.)
+ */
 int bp_is_set(uint32_t addr) {
-    return (bp_find(addr) != -1);
+    int bp = bp_find(addr);
+    return (bp == -1) ? 0 : core->bp_refs[bp];
+}
+
+/**
+ * @brief How many FPB slots are free on a given core (doesn't need the core selected)
+ * 
+ * @param num 
+ * @return int 
+ */
+int bp_free_slots(int num) {
+    int count = 0;
+
+    for (int i=0; i < 4; i++) {
+        if (cores[num].breakpoints[i] == 0xffffffff) count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Write the comparator for a slot (enabled, or fully disabled)
+ */
+static int bp_write(int bp, int enable) {
+    uint32_t addr = core->breakpoints[bp];
+    uint32_t matchword = (addr & 2) ? (0b10 << 30) : (0b01 << 30);
+
+    return mem_write32(bp_reg[bp], enable ? (matchword | (addr & 0x1ffffffc) | (1)) : 0);
 }
 
+/**
+ * @brief Set a hardware breakpoint, the slots are reference counted since GDB
+ *        (Z1), flash software breakpoints and tracepoints can all want the same
+ *        address and each of them will clear it independently.
+ */
 int bp_set(uint32_t addr) {
     int rc;
-    uint32_t matchword;
     int bp = bp_find(addr);
-    if (bp != -1) return SWD_OK;        // already have it
+    if (bp != -1) {                     // already have it
+        core->bp_refs[bp]++;
+        return SWD_OK;
+    }
     bp = bp_find(0xffffffff);
     if (bp == -1) return SWD_ERROR;     // no slots available
 
     // Set the breakpoint...
     core->breakpoints[bp] = addr;
+    core->bp_refs[bp] = 1;
 
-    matchword = (addr & 2) ? (0b10 << 30) : (0b01 << 30);
-
-    rc = mem_write32(bp_reg[bp], matchword | (addr & 0x1ffffffc) | (1));
+    rc = bp_write(bp, 1);
     if (rc != SWD_OK) return rc;
 
     // Turn on the breakpoint system...
@@ -710,28 +766,152 @@ int bp_set(uint32_t addr) {
 }
 
 int bp_clr(uint32_t addr) {
-    int rc;
-
     int bp = bp_find(addr);
     if (bp == -1) return SWD_OK;        // we don't have it? Error?
+    if (core->bp_refs[bp] > 1) {
+        core->bp_refs[bp]--;
+        return SWD_OK;
+    }
+    core->bp_refs[bp] = 0;
     core->breakpoints[bp] = 0xffffffff;
-    rc = mem_write32(bp_reg[bp], 0);      // fully disabled
-    return rc;
+    return bp_write(bp, 0);             // fully disabled
 }
 
+/**
+ * @brief Take a breakpoint out of the FPB (or put it back) without giving up
+ *        the slot, for stepping over it.
+ */
+int bp_pause(uint32_t addr, int pause) {
+    int bp = bp_find(addr);
+    if (bp == -1) return SWD_OK;
+    return bp_write(bp, !pause);
+}
 
 
-int core_enable_debug() {
-    // Enable debug
-    CHECK_OK(mem_write32(DCB_DHCSR, (0xA05F << 16) | 1));
 
+// ----------------------------------------------------------------------------
+// Data watchpoints using the DWT comparators (the M0+ has two per core)
+//
+// The comparator matches addr with the bottom MASK bits ignored, so the size
+// needs to be a power of two and the address aligned to it.
+// ----------------------------------------------------------------------------
+#define DWT_CTRL        0xE0001000
+#define DWT_COMP(n)     (0xE0001020 + ((n) << 4))
+#define DWT_MASK(n)     (0xE0001024 + ((n) << 4))
+#define DWT_FUNCTION(n) (0xE0001028 + ((n) << 4))
+
+#define DWT_MATCHED     (1 << 24)
+#define DWT_MAX_MASK    15
+
+static inline int wp_find(uint32_t addr, uint32_t size, int type) {
+    for (int i=0; i < 2; i++) {
+        struct watch *w = &core->watchpoints[i];
+        if (w->type == type && w->addr == addr && w->size == size) return i;
+    }
+    return -1;
+}
+
+static inline int dwt_function(int type) {
+    switch(type) {
+        case WP_READ:   return 0b0101;
+        case WP_WRITE:  return 0b0110;
+        case WP_ACCESS: return 0b0111;
+    }
+    return 0;
+}
+
+int wp_set(uint32_t addr, uint32_t size, int type) {
+    int wp;
+    int mask = 0;
+
+    // Size must be a power of two and the address aligned to it...
+    if (!size || (size & (size - 1)) || (addr & (size - 1))) return SWD_ERROR;
+    while ((1 << mask) < size) mask++;
+    if (mask > DWT_MAX_MASK) return SWD_ERROR;
+    if (!dwt_function(type)) return SWD_ERROR;
+
+    if (wp_find(addr, size, type) != -1) return SWD_OK;     // already have it
+    wp = wp_find(0, 0, 0);
+    if (wp == -1) return SWD_ERROR;                         // no slots available
+
+    // The DWT needs DWTENA set in DEMCR (leave the vector catch bits alone)...
+    uint32_t demcr;
+    CHECK_OK(mem_read32(DCB_DEMCR, &demcr));
+    if (!(demcr & (1<<24))) CHECK_OK(mem_write32(DCB_DEMCR, demcr | (1<<24)));
+
+    CHECK_OK(mem_write32(DWT_COMP(wp), addr));
+    CHECK_OK(mem_write32(DWT_MASK(wp), mask));
+    CHECK_OK(mem_write32(DWT_FUNCTION(wp), dwt_function(type)));
+
+    core->watchpoints[wp].addr = addr;
+    core->watchpoints[wp].size = size;
+    core->watchpoints[wp].type = type;
+    return SWD_OK;
+}
+
+int wp_clr(uint32_t addr, uint32_t size, int type) {
+    int wp = wp_find(addr, size, type);
+    if (wp == -1) return SWD_OK;
+
+    core->watchpoints[wp].addr = 0;
+    core->watchpoints[wp].size = 0;
+    core->watchpoints[wp].type = 0;
+    return mem_write32(DWT_FUNCTION(wp), 0);
+}
+
+/**
+ * @brief Work out which comparator caused a DWTTRAP (reading FUNCTION clears MATCHED)
+ * 
+ * @return int 
+ */
+static int wp_update_hit() {
+    uint32_t function;
+
+    for (int i=0; i < 2; i++) {
+        if (!core->watchpoints[i].type) continue;
+        CHECK_OK(mem_read32(DWT_FUNCTION(i), &function));
+        if (function & DWT_MATCHED) {
+            core->watch_hit = core->watchpoints[i].addr;
+            core->watch_hit_type = core->watchpoints[i].type;
+            return SWD_OK;
+        }
+    }
+    core->watch_hit_type = 0;
+    return SWD_OK;
+}
+
+int core_get_watch(int num, uint32_t *addr) {
+    *addr = cores[num].watch_hit;
+    return cores[num].watch_hit_type;
+}
+
+/**
+ * @brief Clear any hardware breakpoints and watchpoints on the current core
+ */
+static int core_clear_debug() {
     // Clear each of the breakpoints...
     for (int i=0; i < 4; i++) {
         CHECK_OK(mem_write32(bp_reg[i], 0));
+        core->breakpoints[i] = 0xffffffff;
+        core->bp_refs[i] = 0;
     }
+    // And the watchpoints...
+    for (int i=0; i < 2; i++) {
+        CHECK_OK(mem_write32(DWT_FUNCTION(i), 0));
+        core->watchpoints[i].addr = 0;
+        core->watchpoints[i].size = 0;
+        core->watchpoints[i].type = 0;
+    }
+    core->watch_hit_type = 0;
     return SWD_OK;
 }
 
+int core_enable_debug() {
+    // Enable debug
+    CHECK_OK(mem_write32(DCB_DHCSR, (0xA05F << 16) | 1));
+    return core_clear_debug();
+}
+
 int core_halt() {
     int rc;
     uint32_t value;
@@ -799,7 +979,7 @@ int core_step_avoiding_breakpoint() {
 
     CHECK_OK(reg_read(REG_PC,&pc));
     if (bp_is_set(pc)) {
-        bp_clr(pc);
+        bp_pause(pc, 1);
         had_breakpoint = 1;
     }
 
@@ -814,7 +994,62 @@ int core_step_avoiding_breakpoint() {
 
     // And put the breakpoint back...
     if (had_breakpoint) {
-        bp_set(pc);
+        bp_pause(pc, 0);
+    }
+    return SWD_OK;
+}
+
+#define RANGE_STEP_WAIT     1000        // DHCSR reads before we give up on a step
+
+/**
+ * @brief Single step the current core while the PC stays within [start, end)
+ *
+ * This is the probe side of range stepping (vCont;r) ... rather than sending a
+ * stop reply for every instruction we keep stepping locally and only stop when
+ * we leave the range or land on a breakpoint.
+ *
+ * We do at most max steps so the caller can keep an eye on CTRL-C and the other
+ * core, done is set to 1 if we have finished stepping (core is left halted.)
+ *
+ * @param start
+ * @param end
+ * @param max
+ * @param done
+ * @return int
+ */
+int core_step_range(uint32_t start, uint32_t end, int max, int *done) {
+    uint32_t dhcsr;
+    uint32_t pc;
+
+    *done = 0;
+    while (max--) {
+        CHECK_OK(core_step());
+
+        // Wait for the step to complete, if the core locks up or resets instead it
+        // never will, so we halt it and give up (the caller sends a stop reply)
+        int tries = RANGE_STEP_WAIT;
+        do {
+            CHECK_OK(mem_read32(DCB_DHCSR, &dhcsr));
+            if ((dhcsr & ((1<<19) | (1<<25))) || !tries--) {
+                debug_printf("CORE: range step didn't halt (dhcsr=0x%08x)\r\n", dhcsr);
+                core_halt();
+                core->state = STATE_HALTED;
+                *done = 1;
+                return SWD_ERROR;
+            }
+        } while (!(dhcsr & (1<<17)));
+        core->state = STATE_HALTED;
+
+        CHECK_OK(reg_read(REG_PC, &pc));
+        if ((pc < start) || (pc >= end)) {
+            *done = 1;
+            return SWD_OK;
+        }
+        if (bp_is_set(pc) || sw_bp_is_set(pc)) {
+            core->reason = REASON_BREAKPOINT;
+            *done = 1;
+            return SWD_OK;
+        }
     }
     return SWD_OK;
 }
@@ -850,6 +1085,10 @@ int core_update_status() {
         debug_printf("dfsr=0x%08x\r\n", dfsr);
         core->reason = REASON_BREAKPOINT;
         CHECK_OK(mem_write32(DCB_DFSR, (1<<1)));    // clear the BKPT bit
+    } else if (dfsr & (1<<2)) {
+        core->reason = REASON_WATCHPOINT;
+        CHECK_OK(wp_update_hit());
+        CHECK_OK(mem_write32(DCB_DFSR, (1<<2)));    // clear the DWTTRAP bit
     }
     return SWD_OK;
 }
@@ -858,6 +1097,17 @@ int core_get_reason(int num) {
     return cores[num].reason;
 }
 
+/**
+ * @brief Check just the current core for a halt, used in non-stop mode where
+ *        we don't want to stop the other core (unlike check_cores)
+ * 
+ * @return int 1 if halted, 0 if running, -1 on error
+ */
+int core_check_halted() {
+    if (core_update_status() != SWD_OK) return -1;
+    return (core->state == STATE_HALTED);
+}
+
 
 
 /**
@@ -943,7 +1193,17 @@ uint32_t rp2040_find_rom_func(char ch1, char ch2) {
 }
 
 
-int rp2040_call_function(uint32_t addr, uint32_t args[], int argc) {
+/**
+ * @brief Start a function running on the target (through the rom trampoline) but
+ *        don't wait for it, the core will halt when it's done so the caller can
+ *        poll core_is_halted() and then read r0 for the result.
+ * 
+ * @param addr 
+ * @param args 
+ * @param argc 
+ * @return int 
+ */
+int rp2040_call_start(uint32_t addr, uint32_t args[], int argc) {
     static uint32_t trampoline_addr = 0;
     static uint32_t trampoline_end;
     int rc;
@@ -991,9 +1251,15 @@ int rp2040_call_function(uint32_t addr, uint32_t args[], int argc) {
     if (rc == -1) lerp_panic("aaarg!");
     if (!rc) lerp_panic("core not halted");
 
-    // Now can we continue and just wait for a halt?
+    // Off it goes, it will halt when it gets back to the trampoline end
 //    core_unhalt();
-    core_unhalt_with_masked_ints();
+    return core_unhalt_with_masked_ints();
+}
+
+int rp2040_call_function(uint32_t addr, uint32_t args[], int argc) {
+    int rc;
+
+    CHECK_OK(rp2040_call_start(addr, args, argc));
     while(1) {
         busy_wait_ms(2);
         rc = core_is_halted();
@@ -1131,7 +1397,14 @@ int dp_initialise() {
         cores[i].ap_mem_csw_cache = 0xffffffff;
         for (int j=0; j < 4; j++) {
             cores[i].breakpoints[j] = 0xffffffff;
+            cores[i].bp_refs[j] = 0;
+        }
+        for (int j=0; j < 2; j++) {
+            cores[i].watchpoints[j].addr = 0;
+            cores[i].watchpoints[j].size = 0;
+            cores[i].watchpoints[j].type = 0;
         }
+        cores[i].watch_hit_type = 0;
         for (int j=0; j < sizeof(cores[i].reg_cache)/sizeof(struct reg); j++) {
             cores[i].reg_cache[j].valid = 0;
         }
@@ -1261,9 +1534,74 @@ int check_cores() {
 
 
 
+static int dp_ready = 0;            // has a full init worked (so the DP state is worth reusing)
+
 int dp_init() {
+    dp_ready = 0;
     CHECK_OK(dp_initialise());
     CHECK_OK(core_select(0));
+    dp_ready = 1;
     return SWD_OK;
 }
 
+/**
+ * @brief Check a core is still selectable, powered up and has debug enabled
+ *        from last time.
+ */
+static int dp_core_check(int num) {
+    uint32_t rv;
+
+    CHECK_OK(dp_core_select(num));
+    core = &cores[num];
+    CHECK_OK(dp_read(DP_CTRL_STAT, &rv));
+    if ((rv & SWDERRORS) || !(rv & CDBGPWRUPACK) || !(rv & CSYSPWRUPACK)) return SWD_ERROR;
+    CHECK_OK(mem_read32(DCB_DHCSR, &rv));
+    if (!(rv & 1)) return SWD_ERROR;                // C_DEBUGEN
+    return SWD_OK;
+}
+
+/**
+ * @brief Connect to the target for a new session without disturbing it
+ * 
+ * If we have already initialised the DP (and the target hasn't been power
+ * cycled since) then everything is still powered up and debug enabled, so all
+ * we need is to select each core and clear out the old breakpoints. Otherwise
+ * (or if anything looks wrong) we do the full dp_init().
+ * 
+ * The cores are left as they were (running or halted.)
+ * 
+ * @param cached    set to 1 if we reused the previous state
+ * @return int 
+ */
+int dp_attach(int *cached) {
+    *cached = 0;
+    if (dp_ready) {
+        int ok = 1;
+
+        for (int i=0; i < 2; i++) {
+            cores[i].state = STATE_UNKNOWN;
+            cores[i].reason = REASON_UNDEFINED;
+            cores[i].dp_select_cache = 0xffffffff;      // don't trust what was left
+            cores[i].ap_mem_csw_cache = 0xffffffff;
+            for (int j=0; j < sizeof(cores[i].reg_cache)/sizeof(struct reg); j++) {
+                cores[i].reg_cache[j].valid = 0;
+            }
+        }
+        mem_cache_invalidate();
+
+        for (int i=0; ok && i < 2; i++) {
+            if (dp_core_check(i) != SWD_OK || core_clear_debug() != SWD_OK) ok = 0;
+            if (ok && core_update_status() != SWD_OK) ok = 0;
+        }
+        if (ok) {
+            core = NULL;
+            if (core_select(0) == SWD_OK) {
+                *cached = 1;
+                return SWD_OK;
+            }
+        }
+        debug_printf("ATTACH: previous DP state not usable, doing a full init\r\n");
+    }
+    return dp_init();
+}
+
@@ -30,8 +30,16 @@ enum {
     REASON_UNDEFINED = 8,
 };
 
+// Watchpoint types (match the Z2, Z3 and Z4 packets)
+enum {
+    WP_WRITE = 2,
+    WP_READ = 3,
+    WP_ACCESS = 4,
+};
+
 int swd_init();
 int dp_init();
+int dp_attach(int *cached);
 int swd_test();
 
 int mem_read8(uint32_t addr, uint8_t *res);
@@ -43,6 +51,7 @@ int mem_write8(uint32_t addr, uint8_t value);
 int mem_write16(uint32_t addr, uint16_t value);
 int mem_write32(uint32_t addr, uint32_t value);
 int mem_write_block(uint32_t addr, uint32_t count, uint8_t *src);
+void mem_flush_cache();
 
 int core_select(int num);
 int core_get();
@@ -51,12 +60,15 @@ int core_halt();
 int core_unhalt();
 int core_step();
 int core_step_avoiding_breakpoint();
+int core_step_range(uint32_t start, uint32_t end, int max, int *done);
 int core_is_halted();
 int core_reset_halt();
 int check_cores();
 int core_get_reason(int num);
+int core_check_halted();
 
 uint32_t rp2040_find_rom_func(char ch1, char ch2);
+int rp2040_call_start(uint32_t addr, uint32_t args[], int argc);
 int rp2040_call_function(uint32_t addr, uint32_t args[], int argc);
 
 int reg_read(int reg, uint32_t *res);
@@ -65,5 +77,11 @@ int reg_write(int reg, uint32_t value);
 int bp_set(uint32_t addr);
 int bp_clr(uint32_t addr);
 int bp_is_set(uint32_t addr);
+int bp_pause(uint32_t addr, int pause);
+int bp_free_slots(int num);
+
+int wp_set(uint32_t addr, uint32_t size, int type);
+int wp_clr(uint32_t addr, uint32_t size, int type);
+int core_get_watch(int num, uint32_t *addr);
 
 #endif
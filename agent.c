@@ -0,0 +1,253 @@
+/**
+ * @file agent.c
+ * @author Lee Essen (lee.essen@nowonline.co.uk)
+ * @brief
+ * @version 0.1
+ * @date 2022-08-02
+ *
+ * @copyright Copyright (c) 2022
+ *
+ * A small interpreter for GDB agent expressions, this lets us evaluate
+ * breakpoint conditions (and tracepoint collection) on the probe without
+ * involving GDB at all.
+ *
+ * Registers and memory come from reg_read and mem_read (so we get the benefit
+ * of the caches), anything we don't support (floats, printf, trace state
+ * variables) is treated as an error so the caller can fall back to GDB.
+ *
+ */
+
+#include "pico/stdlib.h"
+#include "lerp/debug.h"
+#include "agent.h"
+#include "swd.h"
+#include "adi.h"
+
+//
+// Opcodes as per the GDB agent expression documentation
+//
+enum {
+    OP_FLOAT = 0x01, OP_ADD, OP_SUB, OP_MUL, OP_DIV_SIGNED, OP_DIV_UNSIGNED,
+    OP_REM_SIGNED, OP_REM_UNSIGNED, OP_LSH, OP_RSH_SIGNED, OP_RSH_UNSIGNED,
+    OP_TRACE, OP_TRACE_QUICK, OP_LOG_NOT, OP_BIT_AND, OP_BIT_OR, OP_BIT_XOR,
+    OP_BIT_NOT, OP_EQUAL, OP_LESS_SIGNED, OP_LESS_UNSIGNED, OP_EXT,
+    OP_REF8, OP_REF16, OP_REF32, OP_REF64,
+
+    OP_IF_GOTO = 0x20, OP_GOTO, OP_CONST8, OP_CONST16, OP_CONST32, OP_CONST64,
+    OP_REG, OP_END, OP_DUP, OP_POP, OP_ZERO_EXT, OP_SWAP, OP_GETV, OP_SETV,
+    OP_TRACEV, OP_TRACENZ, OP_TRACE16, OP_PICK = 0x32, OP_ROT, OP_PRINTF,
+};
+
+#define AGENT_STACK_SIZE        32
+#define AGENT_MAX_OPS           1024        // stop runaway loops
+
+/**
+ * @brief Read a big endian operand of size bytes from the bytecode
+ */
+static inline uint64_t operand(uint8_t *p, int size) {
+    uint64_t v = 0;
+
+    while (size--) v = (v << 8) | *p++;
+    return v;
+}
+
+/**
+ * @brief Read a little endian value of size bytes from the target, built from
+ *        aligned word reads so we get the benefit of the memory cache.
+ */
+static int agent_ref(uint32_t addr, int size, int64_t *res) {
+    uint64_t    v = 0;
+    uint32_t    word;
+
+    for (int i = size - 1; i >= 0; i--) {
+        uint32_t a = addr + i;
+        CHECK_OK(mem_read32(a & ~3, &word));
+        v = (v << 8) | ((word >> ((a & 3) << 3)) & 0xff);
+    }
+    *res = v;
+    return SWD_OK;
+}
+
+/**
+ * @brief Trace until we find a zero byte (or hit the limit)
+ */
+static int agent_tracenz(agent_trace_fn trace, uint32_t addr, int limit) {
+    int len = 0;
+    uint8_t v8;
+
+    while (len < limit) {
+        CHECK_OK(mem_read8(addr + len, &v8));
+        len++;
+        if (!v8) break;
+    }
+    return trace(addr, len);
+}
+
+/**
+ * @brief Evaluate a GDB agent expression, result is the top of the stack at
+ *        the end.
+ *
+ * Returns SWD_OK on success, SWD_ERROR if we can't evaluate it (bad bytecode
+ * or unsupported operations) or the error from a target access.
+ *
+ * @param code
+ * @param len
+ * @param trace
+ * @param result
+ * @return int
+ */
+int agent_eval(uint8_t *code, int len, agent_trace_fn trace, int64_t *result) {
+    int64_t     stack[AGENT_STACK_SIZE];
+    int         sp = 0;                     // next free slot
+    int         pc = 0;
+    int         ops = 0;
+    int64_t     a, b;
+    uint32_t    v32;
+    int         n;
+
+// Make sure we have (or have space for) n items
+#define NEED(n)         if (sp < (n)) return SWD_ERROR
+#define ROOM(n)         if (sp + (n) > AGENT_STACK_SIZE) return SWD_ERROR
+#define ARGS(n)         if (pc + (n) > len) return SWD_ERROR
+#define TOP             stack[sp-1]
+#define BINARY(expr)    NEED(2); b = stack[--sp]; a = TOP; TOP = (expr); break
+
+    while (pc < len) {
+        if (++ops > AGENT_MAX_OPS) return SWD_ERROR;
+
+        uint8_t op = code[pc++];
+        switch(op) {
+            case OP_ADD:            BINARY(a + b);
+            case OP_SUB:            BINARY(a - b);
+            case OP_MUL:            BINARY(a * b);
+            case OP_LSH:            BINARY(a << b);
+            case OP_RSH_SIGNED:     BINARY(a >> b);
+            case OP_RSH_UNSIGNED:   BINARY((uint64_t)a >> b);
+            case OP_BIT_AND:        BINARY(a & b);
+            case OP_BIT_OR:         BINARY(a | b);
+            case OP_BIT_XOR:        BINARY(a ^ b);
+            case OP_EQUAL:          BINARY(a == b);
+            case OP_LESS_SIGNED:    BINARY(a < b);
+            case OP_LESS_UNSIGNED:  BINARY((uint64_t)a < (uint64_t)b);
+
+            case OP_DIV_SIGNED:
+            case OP_DIV_UNSIGNED:
+            case OP_REM_SIGNED:
+            case OP_REM_UNSIGNED:
+                NEED(2);
+                b = stack[--sp]; a = TOP;
+                if (!b) return SWD_ERROR;
+                switch(op) {
+                    case OP_DIV_SIGNED:     TOP = a / b; break;
+                    case OP_DIV_UNSIGNED:   TOP = (uint64_t)a / (uint64_t)b; break;
+                    case OP_REM_SIGNED:     TOP = a % b; break;
+                    case OP_REM_UNSIGNED:   TOP = (uint64_t)a % (uint64_t)b; break;
+                }
+                break;
+
+            case OP_LOG_NOT:        NEED(1); TOP = !TOP; break;
+            case OP_BIT_NOT:        NEED(1); TOP = ~TOP; break;
+
+            case OP_EXT:
+                ARGS(1); NEED(1);
+                n = code[pc++];
+                if (n < 64) TOP = (int64_t)((uint64_t)TOP << (64 - n)) >> (64 - n);
+                break;
+            case OP_ZERO_EXT:
+                ARGS(1); NEED(1);
+                n = code[pc++];
+                if (n < 64) TOP &= ((uint64_t)1 << n) - 1;
+                break;
+
+            case OP_REF8:           NEED(1); CHECK_OK(agent_ref(TOP, 1, &TOP)); break;
+            case OP_REF16:          NEED(1); CHECK_OK(agent_ref(TOP, 2, &TOP)); break;
+            case OP_REF32:          NEED(1); CHECK_OK(agent_ref(TOP, 4, &TOP)); break;
+            case OP_REF64:          NEED(1); CHECK_OK(agent_ref(TOP, 8, &TOP)); break;
+
+            case OP_IF_GOTO:
+                ARGS(2); NEED(1);
+                if (stack[--sp]) {
+                    pc = operand(&code[pc], 2);
+                } else {
+                    pc += 2;
+                }
+                break;
+            case OP_GOTO:
+                ARGS(2);
+                pc = operand(&code[pc], 2);
+                break;
+
+            case OP_CONST8:         ARGS(1); ROOM(1); stack[sp++] = operand(&code[pc], 1); pc += 1; break;
+            case OP_CONST16:        ARGS(2); ROOM(1); stack[sp++] = operand(&code[pc], 2); pc += 2; break;
+            case OP_CONST32:        ARGS(4); ROOM(1); stack[sp++] = operand(&code[pc], 4); pc += 4; break;
+            case OP_CONST64:        ARGS(8); ROOM(1); stack[sp++] = operand(&code[pc], 8); pc += 8; break;
+
+            case OP_REG:
+                ARGS(2); ROOM(1);
+                n = operand(&code[pc], 2);
+                pc += 2;
+                if (n > 18) return SWD_ERROR;       // core and msp/psp only
+                CHECK_OK(reg_read(n, &v32));
+                stack[sp++] = v32;
+                break;
+
+            case OP_END:
+                NEED(1);
+                *result = TOP;
+                return SWD_OK;
+
+            case OP_DUP:            NEED(1); ROOM(1); stack[sp] = stack[sp-1]; sp++; break;
+            case OP_POP:            NEED(1); sp--; break;
+            case OP_SWAP:           NEED(2); a = TOP; TOP = stack[sp-2]; stack[sp-2] = a; break;
+            case OP_PICK:
+                ARGS(1);
+                n = code[pc++];
+                NEED(n + 1); ROOM(1);
+                stack[sp] = stack[sp - 1 - n];
+                sp++;
+                break;
+            case OP_ROT:
+                // a b c => c a b
+                NEED(3);
+                a = stack[sp-1];
+                stack[sp-1] = stack[sp-2];
+                stack[sp-2] = stack[sp-3];
+                stack[sp-3] = a;
+                break;
+
+            case OP_TRACE:
+                NEED(2);
+                b = stack[--sp]; a = stack[--sp];
+                if (trace) CHECK_OK(trace(a, b));
+                break;
+            case OP_TRACE_QUICK:
+                ARGS(1); NEED(1);
+                if (trace) CHECK_OK(trace(TOP, code[pc]));
+                pc += 1;
+                break;
+            case OP_TRACE16:
+                ARGS(2); NEED(1);
+                if (trace) CHECK_OK(trace(TOP, operand(&code[pc], 2)));
+                pc += 2;
+                break;
+            case OP_TRACENZ:
+                NEED(2);
+                b = stack[--sp]; a = stack[--sp];
+                if (trace) CHECK_OK(agent_tracenz(trace, a, b));
+                break;
+
+            default:
+                // float, printf, trace state variables etc.
+                debug_printf("AGENT: unsupported opcode 0x%02x\r\n", op);
+                return SWD_ERROR;
+        }
+    }
+    // We ran off the end without an OP_END
+    return SWD_ERROR;
+
+#undef NEED
+#undef ROOM
+#undef ARGS
+#undef TOP
+#undef BINARY
+}
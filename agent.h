@@ -0,0 +1,12 @@
+
+#ifndef __AGENT_H
+#define __AGENT_H
+
+#include <stdint.h>
+
+// Called for the trace bytecodes (addr/len to collect), can be NULL
+typedef int (*agent_trace_fn)(uint32_t addr, int len);
+
+int agent_eval(uint8_t *code, int len, agent_trace_fn trace, int64_t *result);
+
+#endif
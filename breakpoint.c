@@ -1,60 +1,452 @@
 #include <stdlib.h>
+#include <string.h>
 #include "pico/stdlib.h"
+#include "lerp/debug.h"
 #include "breakpoint.h"
+#include "agent.h"
+#include "monitor.h"
 #include "swd.h"
 #include "adi.h"
 
+#define UNUSED              __attribute__ ((unused))
+
+// ------------------------------------------------------------------------------
+// Software breakpoints
+//
+// GDB removes and re-inserts every breakpoint around each stop, so rather than
+// touching the target on every Z0/z0 we just record what GDB wants and then at
+// resume time (bp_sync) compare that with what is actually installed and only
+// apply the differences.
 //
-// Rushed implementation of software breakpoints ... need to redo
+// Changes to RAM addresses that are close together are done with one block read
+// and one block write, flash addresses (which we can't patch) use FPB slots on
+// both cores instead.
 //
+// While a breakpoint is installed we hide it from GDB memory reads (and keep the
+// original up to date if GDB writes over it.)
+//
+// Tracepoints use the same table, so each entry records who wants it and it only
+// comes out when nobody does.
+// ------------------------------------------------------------------------------
+
+#define SWBP_MAX            64
+#define SWBP_BATCH_SPAN     64          // changes within this many bytes are batched
+#define IS_FLASH(addr)      ((addr) < 0x20000000)
+
+#define SWBP_GDB            (1 << 0)
+#define SWBP_TRACE          (1 << 1)
 
 struct swbp {
-    struct swbp *next;
     uint32_t    addr;
-    int         size;
-    uint32_t    orig;
+    uint8_t     size;               // zero means the slot is free
+    uint8_t     wanted;             // who wants it in (SWBP_GDB, SWBP_TRACE)
+    uint8_t     installed;          // it's actually in the target (or FPB)
+    uint8_t     orig[4];            // original instruction (RAM only)
 };
-struct swbp *sw_breakpoints = NULL;
+static struct swbp swbps[SWBP_MAX];
+
+static const uint8_t bkpt_code[4] = { 0x11, 0xbe, 0x11, 0xbe };
 
 static struct swbp *find_swbp(uint32_t addr) {
-    struct swbp *p = sw_breakpoints;
-    while (p) {
-        if (p->addr == addr) return p;
-        p = p->next;
+    for (int i=0; i < SWBP_MAX; i++) {
+        if (swbps[i].size && swbps[i].addr == addr) return &swbps[i];
     }
     return NULL;
 }
 
-int sw_bp_set(uint32_t addr, int size) {
-    if (!find_swbp(addr)) {
-        struct swbp *bp = malloc(sizeof(struct swbp));
+int sw_bp_is_set(uint32_t addr) {
+    struct swbp *bp = find_swbp(addr);
+    return (bp && bp->wanted);
+}
+
+/**
+ * @brief Is this one that GDB asked for (rather than just a tracepoint)?
+ */
+int sw_bp_is_user(uint32_t addr) {
+    struct swbp *bp = find_swbp(addr);
+    return (bp && (bp->wanted & SWBP_GDB));
+}
+
+/**
+ * @brief Would we have an FPB slot for one more flash breakpoint on both cores
+ *        once the pending changes are made?
+ */
+static int fpb_available() {
+    int needed = 1;
+
+    for (int i=0; i < SWBP_MAX; i++) {
+        struct swbp *bp = &swbps[i];
+        if (!bp->size || !IS_FLASH(bp->addr)) continue;
+        if (bp->wanted && !bp->installed) needed++;
+        if (!bp->wanted && bp->installed) needed--;
+    }
+    return (needed <= MIN(bp_free_slots(0), bp_free_slots(1)));
+}
+
+static int sw_bp_want(uint32_t addr, int size, int owner) {
+    struct swbp *bp = find_swbp(addr);
+
+    if (bp && bp->wanted) {
+        bp->wanted |= owner;
+        return SWD_OK;
+    }
+    if (size != 2 && size != 4) return SWD_ERROR;
+    if (IS_FLASH(addr) && !(bp && bp->installed) && !fpb_available()) return SWD_ERROR;
+
+    if (!bp) {
+        for (int i=0; !bp && i < SWBP_MAX; i++) {
+            if (!swbps[i].size) bp = &swbps[i];
+        }
+        if (!bp) return SWD_ERROR;
         bp->addr = addr;
         bp->size = size;
-        CHECK_OK(mem_read_block(addr, size, (uint8_t *)&(bp->orig)));
-        uint32_t code = 0xbe11be11;
-        mem_write_block(addr, size, (uint8_t *)&code);
-        bp->next = sw_breakpoints;
-        sw_breakpoints = bp;
+        bp->installed = 0;
     }
+    bp->wanted = owner;
     return SWD_OK;
 }
-int sw_bp_clr(uint32_t addr, int size) {
+
+static int sw_bp_unwant(uint32_t addr, int owner) {
     struct swbp *bp = find_swbp(addr);
+
     if (bp) {
-        CHECK_OK(mem_write_block(bp->addr, bp->size, (uint8_t *)&bp->orig));
-        if (sw_breakpoints == bp) {
-            sw_breakpoints = bp->next;
+        bp->wanted &= ~owner;
+        if (!bp->wanted && !bp->installed) bp->size = 0;
+    }
+    return SWD_OK;
+}
+
+int sw_bp_set(uint32_t addr, int size) {
+    return sw_bp_want(addr, size, SWBP_GDB);
+}
+
+int sw_bp_clr(uint32_t addr, UNUSED int size) {
+    return sw_bp_unwant(addr, SWBP_GDB);
+}
+
+/**
+ * @brief Tracepoints put their breakpoints in (and take them out) separately from
+ *        GDB, so one doesn't remove the other.
+ */
+int sw_bp_trace(uint32_t addr, int size, int set) {
+    return set ? sw_bp_want(addr, size, SWBP_TRACE) : sw_bp_unwant(addr, SWBP_TRACE);
+}
+
+/**
+ * @brief Forget everything (e.g. on a new connection, the target will be reset)
+ */
+void sw_bp_reset() {
+    memset(swbps, 0, sizeof(swbps));
+}
+
+/**
+ * @brief Take all of the breakpoints out of the target (e.g. when GDB goes away
+ *        and the target may not be reset before the next session)
+ */
+int sw_bp_remove_all() {
+    for (int i=0; i < SWBP_MAX; i++) {
+        if (swbps[i].size) swbps[i].wanted = 0;
+    }
+    return bp_sync();
+}
+
+/**
+ * @brief Apply the changes for a run of RAM breakpoints [first,last] (sorted by address)
+ *        with a single read and write.
+ */
+static int sync_ram_block(struct swbp **list, int count) {
+    static uint8_t block[SWBP_BATCH_SPAN + 4];
+    uint32_t start = list[0]->addr;
+    uint32_t len = (list[count-1]->addr + list[count-1]->size) - start;
+
+    CHECK_OK(mem_read_block(start, len, block));
+    for (int i=0; i < count; i++) {
+        struct swbp *bp = list[i];
+        uint8_t *p = block + (bp->addr - start);
+
+        if (bp->wanted) {
+            memcpy(bp->orig, p, bp->size);
+            memcpy(p, bkpt_code, bp->size);
         } else {
-            struct swbp *p = sw_breakpoints;
-            while (p) {
-                if (p->next == bp) {
-                    p->next = bp->next;
-                    break;
-                }
-                p = p->next;
+            memcpy(p, bp->orig, bp->size);
+        }
+    }
+    CHECK_OK(mem_write_block(start, len, block));
+
+    for (int i=0; i < count; i++) {
+        list[i]->installed = (list[i]->wanted != 0);
+        if (!list[i]->installed) list[i]->size = 0;
+    }
+    return SWD_OK;
+}
+
+/**
+ * @brief Flash breakpoints go into the FPB on both cores (the slots are shared
+ *        with Z1 and tracepoints, bp_set/bp_clr count the users)
+ */
+static int sync_flash(struct swbp *bp) {
+    int cur = core_get();
+    int rc = SWD_OK;
+
+    for (int c=0; c < 2 && rc == SWD_OK; c++) {
+        core_select(c);
+        rc = bp->wanted ? bp_set(bp->addr) : bp_clr(bp->addr);
+    }
+    core_select(cur);
+    if (rc != SWD_OK) return rc;
+
+    bp->installed = (bp->wanted != 0);
+    if (!bp->installed) bp->size = 0;
+    return SWD_OK;
+}
+
+/**
+ * @brief Make the target match what GDB wants, called before we resume.
+ * 
+ * @return int 
+ */
+int bp_sync() {
+    struct swbp *list[SWBP_MAX];
+    int count = 0;
+
+    // Build a sorted list of the RAM ones that need changing (flash done as we go)...
+    for (int i=0; i < SWBP_MAX; i++) {
+        struct swbp *bp = &swbps[i];
+        if (!bp->size || (bp->wanted != 0) == bp->installed) continue;
+
+        if (IS_FLASH(bp->addr)) {
+            CHECK_OK(sync_flash(bp));
+            continue;
+        }
+        int j = count++;
+        while (j > 0 && list[j-1]->addr > bp->addr) {
+            list[j] = list[j-1];
+            j--;
+        }
+        list[j] = bp;
+    }
+
+    // Now do them in batches of nearby addresses...
+    int first = 0;
+    for (int i=1; i <= count; i++) {
+        if (i == count || (list[i]->addr + list[i]->size) - list[first]->addr > SWBP_BATCH_SPAN) {
+            CHECK_OK(sync_ram_block(&list[first], i - first));
+            first = i;
+        }
+    }
+    return SWD_OK;
+}
+
+/**
+ * @brief Replace any installed breakpoints in some memory we've read with the
+ *        original contents.
+ */
+void bp_hide(uint32_t addr, int len, uint8_t *buf) {
+    for (int i=0; i < SWBP_MAX; i++) {
+        struct swbp *bp = &swbps[i];
+        if (!bp->installed || IS_FLASH(bp->addr)) continue;
+
+        for (int b=0; b < bp->size; b++) {
+            uint32_t a = bp->addr + b;
+            if (a >= addr && a < addr + len) buf[a - addr] = bp->orig[b];
+        }
+    }
+}
+
+/**
+ * @brief Is there an installed (RAM) breakpoint anywhere in the range?
+ */
+int bp_hidden_in(uint32_t addr, int len) {
+    for (int i=0; i < SWBP_MAX; i++) {
+        struct swbp *bp = &swbps[i];
+        if (!bp->installed || IS_FLASH(bp->addr)) continue;
+        if (bp->addr < addr + len && addr < bp->addr + bp->size) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Before writing to memory, update the original for any installed breakpoints
+ *        that we are about to overwrite and keep the breakpoint in place.
+ */
+void bp_patch_write(uint32_t addr, int len, uint8_t *buf) {
+    for (int i=0; i < SWBP_MAX; i++) {
+        struct swbp *bp = &swbps[i];
+        if (!bp->installed || IS_FLASH(bp->addr)) continue;
+
+        for (int b=0; b < bp->size; b++) {
+            uint32_t a = bp->addr + b;
+            if (a >= addr && a < addr + len) {
+                bp->orig[b] = buf[a - addr];
+                buf[a - addr] = bkpt_code[b];
             }
         }
-        free(bp);
+    }
+}
+
+// ------------------------------------------------------------------------------
+// Breakpoint conditions (agent expression bytecode) evaluated on the probe
+//
+// We keep the conditions separately from the breakpoints themselves since they
+// apply to both the hardware and software ones. Each condition is stored as a
+// length byte followed by the bytecode, the breakpoint stops if any are true.
+//
+// The counters are kept separately again, by address, since GDB removes and
+// re-inserts the breakpoint (and its conditions) around every stop.
+// ------------------------------------------------------------------------------
+
+#define BP_COND_MAX         8
+#define BP_COND_BYTES       128
+#define BP_STAT_MAX         16
+
+struct bpcond {
+    uint32_t    addr;
+    int         len;                    // zero means unused
+    uint8_t     code[BP_COND_BYTES];
+};
+static struct bpcond bp_conds[BP_COND_MAX];
+
+struct bpstat {
+    uint32_t    addr;
+    uint32_t    hits;                   // how many times did we hit the breakpoint
+    uint32_t    evals;                  // how many conditions did we evaluate
+    uint32_t    stops;                  // how many times did we actually stop
+};
+static struct bpstat bp_stats[BP_STAT_MAX];
+static int bp_stat_count = 0;
+
+/**
+ * @brief Find the counters for a conditional breakpoint, creating them if asked
+ *        (and there's room)
+ */
+static struct bpstat *find_stat(uint32_t addr, int create) {
+    for (int i=0; i < bp_stat_count; i++) {
+        if (bp_stats[i].addr == addr) return &bp_stats[i];
+    }
+    if (!create || bp_stat_count >= BP_STAT_MAX) return NULL;
+
+    struct bpstat *s = &bp_stats[bp_stat_count++];
+    memset(s, 0, sizeof(struct bpstat));
+    s->addr = addr;
+    return s;
+}
+
+static struct bpcond *find_cond(uint32_t addr) {
+    for (int i=0; i < BP_COND_MAX; i++) {
+        if (bp_conds[i].len && bp_conds[i].addr == addr) return &bp_conds[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Set (or replace) the conditions for a breakpoint, len of zero removes them
+ * 
+ * @param addr 
+ * @param conds 
+ * @param len 
+ * @return int 
+ */
+int bp_cond_set(uint32_t addr, uint8_t *conds, int len) {
+    struct bpcond *c = find_cond(addr);
+
+    if (c) c->len = 0;
+    if (!len) return SWD_OK;
+    if (len > BP_COND_BYTES) return SWD_ERROR;
+
+    c = NULL;
+    for (int i=0; !c && i < BP_COND_MAX; i++) {
+        if (!bp_conds[i].len) c = &bp_conds[i];
+    }
+    if (!c) return SWD_ERROR;
+
+    c->addr = addr;
+    c->len = len;
+    memcpy(c->code, conds, len);
+    find_stat(addr, 1);
+    return SWD_OK;
+}
+
+/**
+ * @brief Should we stop at this breakpoint? If there are no conditions, one of
+ *        them is true, or we can't evaluate them then yes.
+ * 
+ * @param addr 
+ * @return int 
+ */
+int bp_should_stop(uint32_t addr) {
+    struct bpcond *c = find_cond(addr);
+    struct bpstat *s = find_stat(addr, 0);
+    struct bpstat dummy = { 0 };
+    uint8_t *p;
+    int64_t result;
+
+    if (!s) s = &dummy;
+    s->hits++;
+    if (!c) {
+        s->stops++;
+        return 1;
+    }
+
+    p = c->code;
+    while (p < c->code + c->len) {
+        int len = *p++;
+
+        s->evals++;
+        if (agent_eval(p, len, NULL, &result) != SWD_OK || result) {
+            s->stops++;
+            return 1;
+        }
+        p += len;
+    }
+    return 0;
+}
+
+// ------------------------------------------------------------------------------
+// Monitor command
+// ------------------------------------------------------------------------------
+
+static int mon_bpstats(char *args) {
+    if (strcmp(args, "reset") == 0) {
+        bp_stat_count = 0;
+        mon_printf("bpstats reset\n");
+        return SWD_OK;
+    }
+    for (int i=0; i < bp_stat_count; i++) {
+        struct bpstat *s = &bp_stats[i];
+        mon_printf("bp.0x%08x hits=%u evals=%u stops=%u cond=%d\n", s->addr, s->hits, s->evals, s->stops,
+                                                find_cond(s->addr) != NULL);
     }
     return SWD_OK;
 }
+
+void bp_init() {
+    monitor_register("bpstats", "[reset] ... hit and condition counts for conditional breakpoints", mon_bpstats);
+}
+
+/**
+ * @brief Step the current core over a breakpoint at addr and let it run again
+ * 
+ * We need to take the breakpoint out (hardware or software) for the step
+ * otherwise we would just hit it again.
+ * 
+ * @param addr 
+ * @return int 
+ */
+int bp_step_over(uint32_t addr) {
+    struct swbp *sw = find_swbp(addr);
+    int hw = bp_is_set(addr);
+    int rc;
+
+    if (sw && (!sw->installed || IS_FLASH(addr))) sw = NULL;
+
+    if (hw) CHECK_OK(bp_pause(addr, 1));
+    if (sw) CHECK_OK(mem_write_block(sw->addr, sw->size, sw->orig));
+
+    CHECK_OK(core_step());
+    while ((rc = core_is_halted()) == 0);
+    if (rc < 0) return SWD_ERROR;
+
+    if (sw) CHECK_OK(mem_write_block(sw->addr, sw->size, (uint8_t *)bkpt_code));
+    if (hw) CHECK_OK(bp_pause(addr, 0));
+    return core_unhalt();
+}
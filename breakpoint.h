@@ -5,5 +5,20 @@
 
 int sw_bp_set(uint32_t addr, int size);
 int sw_bp_clr(uint32_t addr, int size);
+int sw_bp_is_set(uint32_t addr);
+int sw_bp_is_user(uint32_t addr);
+int sw_bp_trace(uint32_t addr, int size, int set);
+void sw_bp_reset();
+int sw_bp_remove_all();
+
+int bp_sync();
+void bp_hide(uint32_t addr, int len, uint8_t *buf);
+int bp_hidden_in(uint32_t addr, int len);
+void bp_patch_write(uint32_t addr, int len, uint8_t *buf);
+
+void bp_init();
+int bp_cond_set(uint32_t addr, uint8_t *conds, int len);
+int bp_should_stop(uint32_t addr);
+int bp_step_over(uint32_t addr);
 
 #endif
@@ -9,6 +9,7 @@
 #include "lerp/io.h"
 #include "lerp/tokeniser.h"
 #include "config/config.h"
+#include "stats.h"
 
 #include "pico/cyw43_arch.h"
 
@@ -118,6 +119,25 @@ void cmd_save(struct io *io, __unused struct circ *circ) {
     io_printf(io, "config saved to flash.\r\n");
 }
 
+//
+// GDB packet statistics (same as "monitor stats" in GDB)
+//
+// stats
+// stats reset
+//
+void cmd_stats(struct io *io, struct circ *circ) {
+    char line[256];
+    int n = 0;
+
+    int tok = token_get(circ);
+    if (tok == TOK_WORD && strcmp(token_string(), "reset") == 0) {
+        stats_reset();
+        io_printf(io, "stats reset.\r\n");
+        return;
+    }
+    while (stats_line(n++, line, sizeof(line))) io_printf(io, "%s\r\n", line);
+}
+
 
 struct cmd_item {
     char    *cmd;
@@ -129,6 +149,7 @@ struct cmd_item commands[] = {
     { "set",    cmd_set },
     { "join",   cmd_join },
     { "save",   cmd_save },
+    { "stats",  cmd_stats },
     { NULL, NULL },
 };
 
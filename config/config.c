@@ -81,6 +81,26 @@ static char *set_string_str(struct cf_info *c, char *val) {
 static char *get_string_str(struct cf_info *c) {
     return CF_STRP(c->offset);
 }
+static char *set_enum_str(struct cf_info *c, char *val) {
+    char **names = (char **)c->vp1;
+    for (int i=0; i < c->iv2; i++) {
+        if (strcasecmp(val, names[i]) == 0) {
+            *CF_INTP(c->offset) = i;
+            return NULL;
+        }
+    }
+    strcpy(cf_err, "value must be one of:");
+    for (int i=0; i < c->iv2; i++) {
+        strcat(cf_err, " ");
+        strcat(cf_err, names[i]);
+    }
+    return cf_err;
+}
+static char *get_enum_str(struct cf_info *c) {
+    int v = *CF_INTP(c->offset);
+    if (v < 0 || v >= c->iv2) return "<err>";
+    return ((char **)c->vp1)[v];
+}
 
 
 // ---------------------------------------------------------------------------------
@@ -92,8 +112,11 @@ static const struct cf_main cf_main_defaults = {
     .swd = { .speed = 25000, .pin_clk = 2, .pin_io = 3 },
     .dhcp = { .enable = 1 },
     .wifi = { .ssid = "", .creds = "" },
+    .gdb = { .attach = CF_ATTACH_RESET },
 };
 
+static const char *attach_names[] = { "reset", "halt", "none" };
+
 // ---------------------------------------------------------------------------------
 // The main configuration table...
 // ---------------------------------------------------------------------------------
@@ -116,6 +139,10 @@ static const struct cf_info cf_list[] = {
         CF_OFFSET(wifi.creds), 0, 32, NULL, NULL,
         get_string_str, NULL, set_string_str, NULL },
 
+    { "gdb.attach", "how a new GDB session connects to the target (reset, halt, none)",
+        CF_OFFSET(gdb.attach), 0, 3, (void *)attach_names, NULL,
+        get_enum_str, NULL, set_enum_str, NULL },
+
     { NULL, NULL, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL }
 };      
 
@@ -208,7 +235,9 @@ void cf_version_upgrade(int oldversion) {
     // Then copy over (or adjust) anything we want to keep
     switch(oldversion) {
 
-        case 1:     
+        case 1:     // version 2 added the gdb section on the end
+            memcpy(cf->main, cf->flash, offsetof(struct cf_main, gdb));
+            cf->main->version = CF_VERSION;
             break;
 
 
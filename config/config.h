@@ -5,7 +5,10 @@
 #include <stdint.h>
 #include "lerp/circ.h"
 
-#define CF_VERSION      1
+#define CF_VERSION      2
+
+// How we connect to the target for a new GDB session
+enum { CF_ATTACH_RESET = 0, CF_ATTACH_HALT, CF_ATTACH_NONE };
 
 struct cf_main {
     int             version;
@@ -29,6 +32,10 @@ struct cf_main {
         uint32_t    pin_rx;
         uint32_t    pin_tx;
     } uart;
+
+    struct {
+        uint32_t    attach;
+    } gdb;
 };
 
 
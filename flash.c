@@ -17,8 +17,20 @@
  * 
  * 1. Copy over stuff in up to 64k chunks
  * 2. Go throug the 64k chunk and compare it in 4k blocks with existing image
- * 3. If more than 2 x 4k blocks need programming then do the whole thing
- * 4. Otherwise do the 4k block individually
+ * 3. Work out the cheapest mix of 4K, 32K and 64K erases (using the timings we
+ *    have seen for this flash), sectors that are already blank aren't erased
+ * 4. Program the pages that aren't blank
+ * 5. The target skips any erase where the changed sectors only clear bits, and
+ *    just programs the pages that are different
+ * 
+ * The target works on one chunk while we copy the next one over, so a full
+ * flash takes about as long as the slower of the two rather than both.
+ * 
+ * Only sectors that differ from the flash are sent, and those are compressed
+ * (see lz.h) if it makes them smaller, the target unpacks them before use.
+ * 
+ * The hashes of what we wrote are kept on the probe (see flash_index.c) so if
+ * it's the same board next time we don't need to hash the flash again.
  * 
  * But this algorithm really needs to run on the remote device so we need
  * to produce some relocatable code to do it.
@@ -29,129 +41,1455 @@
 #include "swd.h"
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 #include "pico/stdlib.h"
 #include "lerp/debug.h"
+#include "lerp/task.h"
 
 #include "adi.h"
+#include "lz.h"
+#include "monitor.h"
+#include "flash_index.h"
+#include "breakpoint.h"
 
 #define FOR_TARGET          __attribute__((noinline, section("for_target")))
+#define UNUSED              __attribute__ ((unused))
 #define DATA_BUFFER         0x20000000
-#define CODE_START          0x20010000
-#define BOOT2_START         0x20020000
+#define SCRATCH_BUFFER      0x20020000
+#define CODE_START          0x20030000
+#define BOOT2_START         0x2003f000
 #define STACK_ADDDR         0x20040800
 #define FLASH_BASE          0x10000000
 
 static int flash_code_copied = 0;
 
+// The data buffer on the target is two 64K buffers used in turn, one is being
+// programmed (by the target, in the background) while the next chunk is built
+// up in the other.
+#define CHUNK_SIZE          65536
+#define CHUNK_BUFFERS       2
+#define CHUNK_BUFFER(n)     (DATA_BUFFER + ((n) * CHUNK_SIZE))
+#define CHUNK_NEXT(n)       (((n) + 1) % CHUNK_BUFFERS)
+
+static uint32_t     chunk_start = 0;        // flash address of the start (64K aligned)
+static uint32_t     chunk_size = 0;         // how far into it we have data (by address)
+static int          chunk_buf = 0;          // which data buffer
+static int          chunk_done = 0;         // how much has been through chunk_process()
+static uint32_t     chunk_mask = 0;         // which 4K sectors have changed (and are on the target)
+
+// The chunk the target is currently programming (if any)
+static int          prog_busy = 0;
+static uint32_t     prog_offset;
+static uint32_t     prog_start_time;
+
+// Incoming data is kept on the probe a sector at a time until we know if it's
+// different to what's already in the flash, only the changed sectors are sent over.
+// There are enough slots for the partial sector plus a full (64K) packet.
+//
+// A slot is filled with 0xff when we start a sector, GDB has to erase anything
+// before it writes it so that's what belongs in any gaps. Sectors we get nothing
+// for are left alone.
+#define SECTOR_SIZE         4096
+#define SECTORS_PER_CHUNK   (CHUNK_SIZE / SECTOR_SIZE)
+#define SECTOR_SLOTS        17
+#define SLOT_NUM(offset)    (((offset) / SECTOR_SIZE) % SECTOR_SLOTS)
+#define SECTOR_FLOOR(x)     ((x) & ~(SECTOR_SIZE - 1))
+#define SECTOR_CEIL(x)      SECTOR_FLOOR((x) + SECTOR_SIZE - 1)
+
+static uint8_t      sector_data[SECTOR_SLOTS][SECTOR_SIZE];
+static uint32_t     slot_sector[SECTOR_SLOTS];      // sector number in each slot plus one (0 = empty)
+
+// CRC32 of each sector of the flash at hash_offset (as it was before we started)
+#define HASH_BUFFER         (BOOT2_START + 0x100)
+#define HASH_NONE           0xffffffff
+
+static uint32_t     hash_offset = HASH_NONE;
+static uint32_t     hashes[SECTORS_PER_CHUNK];
+static uint32_t     chunk_crc[SECTORS_PER_CHUNK];   // of the new data (FINDEX_UNKNOWN if we had none)
+static int          flash_hashed = 0;               // flash_hash has run this session (boot2 copied)
+
+// The saved hashes for this board (if we have them), checked once per session
+#define SECTOR_NUM(offset)  ((offset) / SECTOR_SIZE)
+#define INDEX_SPOT_CHECKS   4
+
+static int          index_checked = 0;
+static int          index_ok = 0;
+
+// Types of flash operation (for the plan and the timings)
+enum { OP_4K = 0, OP_32K, OP_64K, OP_PAGE, OP_COUNT };
+
+// What flash_block needs to know about the sectors in each data buffer (the plan), a
+// compressed sector is at the end of its space in the buffer. The target fills in
+// how many of each operation it did and how long they took.
+struct chunk_info {
+    uint32_t        mask;                       // which sectors have changed
+    uint32_t        keep;                       // unchanged sectors caught up in a bigger erase
+    uint16_t        clen[SECTORS_PER_CHUNK];    // compressed length (or 0 if it isn't)
+    uint8_t         erase[SECTORS_PER_CHUNK];   // erase this many sectors from here (1, 8 or 16)
+    uint32_t        noerase;                    // (from the target) programmed without an erase
+    uint32_t        qpp;                        // quad page program command (0 to use the ROM)
+    uint32_t        baudr;                      // SSI divider for erase/program (0 to leave it)
+    uint32_t        pre_offset;                 // erase ahead for the next chunk (see chunk_pre_plan)
+    uint8_t         pre_erase[SECTORS_PER_CHUNK];
+    uint32_t        op_count[OP_COUNT];
+    uint32_t        op_us[OP_COUNT];            // zero if the target timer isn't running
+    uint32_t        verify_mask;                // CRC these sectors once they are done
+    uint32_t        verify[SECTORS_PER_CHUNK];  // (from the target)
+};
+#define CHUNK_INFO(n)       (BOOT2_START + 0x200 + ((n) * sizeof(struct chunk_info)))
+#define LZ_MIN_SAVING       64          // not worth unpacking for less than this
+
+// If the target is still on its reset clocks we run it from the PLL while we are
+// flashing, this is how it was before (so we can put it back.)
+struct clock_save {
+    uint32_t        boosted;
+    uint32_t        xosc_stable;
+    uint32_t        ref_ctrl;
+    uint32_t        sys_ctrl;
+    uint32_t        sys_div;
+    uint32_t        pll_reset;
+    uint32_t        pll_pwr;
+    uint32_t        before_khz;                 // clk_sys before and after (0 if we can't tell)
+    uint32_t        after_khz;
+};
+#define CLOCK_SAVE          (BOOT2_START + 0x400)
+#define BOOST_BAUDR         4                   // 31MHz SPI clock at 125MHz
+
+static uint16_t     chunk_clen[SECTORS_PER_CHUNK];
+static uint32_t     flash_qpp = 0;              // quad page program command (if the flash has one)
+static int          clock_boosted = 0;
+static int          flash_verify = 0;           // CRC each sector after programming
+static uint32_t     prog_expect[SECTORS_PER_CHUNK];     // what the verify should give
+static uint32_t     clock_khz[2];               // clk_sys before and after, for the last session
+static int          prog_buf;                   // which buffer is being programmed
+
+// How long each operation takes (typical values to start with, then what we see)
+static uint32_t     op_est_us[OP_COUNT] = { 45000, 120000, 150000, 400 };
+
+// Totals for this flash session, and the last one (for the monitor command)
+struct plan_totals {
+    uint32_t        op_count[OP_COUNT];
+    uint32_t        op_us[OP_COUNT];
+    uint32_t        blank_skipped;              // changed sectors we didn't need to erase
+    uint32_t        erase_free;                 // changed sectors that only cleared bits
+    uint32_t        pre_erased;                 // sectors erased ahead of their data
+    uint32_t        index_chunks;               // chunks we had the hashes for already
+    uint32_t        verified;                   // sectors checked after programming
+};
+static struct plan_totals   plan_now, plan_last;
+static uint32_t     flash_bytes_in = 0;         // how much we've been given
+static uint32_t     flash_bytes_sent = 0;       // and how much actually went over SWD
+
+// The ranges GDB has told us it's going to write (vFlashErase), if most of each chunk is
+// changing then we erase the next one at the end of programming this one.
+#define ERASE_RANGES        8
+#define PRE_ERASE_MIN       12          // changed sectors (of 16) before we start erasing ahead
+
+static struct { uint32_t start, end; } erase_ranges[ERASE_RANGES];
+static int          erase_range_count = 0;
+static int          rewriting = 0;              // the last chunk was mostly changed
+
+extern char __start_for_target[];
+extern char __stop_for_target[];
+
+// Where a function in the for_target section ends up on the target
+#define TARGET_FUNC(f)      (CODE_START + (((uint32_t)(f) & ~1) - (uint32_t)__start_for_target))
+
+FOR_TARGET void flash_hash(uint32_t offset, uint32_t *out, int count);
+FOR_TARGET void clock_boost(struct clock_save *save);
+FOR_TARGET void clock_restore(struct clock_save *save);
+static uint32_t crc32_update(uint32_t crc, uint8_t *buf, int len);
+static uint32_t flash_quad_detect();
+static int flash_uid(uint8_t *uid);
+
+/**
+ * @brief Get the target onto the PLL (if it isn't already) for the flashing
+ */
+static int flash_clock_up() {
+    struct clock_save save;
+    uint32_t args[] = { CLOCK_SAVE };
+
+    CHECK_OK(rp2040_call_function(TARGET_FUNC(clock_boost), args, sizeof(args)/sizeof(uint32_t)));
+    CHECK_OK(mem_read_block(CLOCK_SAVE, sizeof(save), (uint8_t *)&save));
+    clock_boosted = save.boosted;
+    clock_khz[0] = save.before_khz;
+    clock_khz[1] = save.after_khz;
+    debug_printf("FLASH: clk_sys %dkHz -> %dkHz (%s)\r\n", clock_khz[0], clock_khz[1],
+                                                clock_boosted ? "boosted" : "left alone");
+    return SWD_OK;
+}
+
+/**
+ * @brief Put the clocks back how they were (the code must still be there)
+ */
+static int flash_clock_down() {
+    uint32_t args[] = { CLOCK_SAVE };
+
+    if (!clock_boosted) return SWD_OK;
+    clock_boosted = 0;
+    return rp2040_call_function(TARGET_FUNC(clock_restore), args, sizeof(args)/sizeof(uint32_t));
+}
+
+/**
+ * @brief Copy the code over ... only needed once per flashing cycle
+ * 
+ * @return int 
+ */
+static int flash_copy_code() {
+    int rc;
+
+    if (!flash_code_copied) {
+        int code_len = (__stop_for_target - __start_for_target);
+        debug_printf("FLASH: Copying custom flash code to 0x%08x (%d bytes)\r\n", CODE_START, code_len);
+        rc = mem_write_block(CODE_START, code_len, (uint8_t *)__start_for_target);
+        if (rc != SWD_OK) return rc;
+        if (!clock_boosted) {
+            rc = flash_clock_up();
+            if (rc != SWD_OK) return rc;
+        }
+        flash_qpp = flash_quad_detect();
+        flash_code_copied = 1;
+    }
+    return SWD_OK;
+}
+
+/**
+ * @brief Wait for the target to finish programming the previous chunk (if it's
+ *        still going), other tasks carry on while we wait.
+ * 
+ * @return int 
+ */
+static int chunk_wait() {
+    uint32_t r0, erased, programmed;
+    int rc;
+
+    if (!prog_busy) return SWD_OK;
+    while ((rc = core_is_halted()) == 0) task_sleep_ms(1);
+    prog_busy = 0;
+    if (rc != 1) return SWD_ERROR;
+
+    CHECK_OK(reg_read(0, &r0));
+    erased = (r0 >> 24) * 4;
+    programmed = r0 & 0x00ffffff;
+
+    debug_printf("FLASH: 0x%08x erased %dk and programmed %d bytes in %dms\r\n", prog_offset, erased,
+                                                programmed, (time_us_32() - prog_start_time)/1000);
+
+    // See how long things took, and keep a running average for the planner
+    static struct chunk_info info;      // (too big for the task stacks)
+    CHECK_OK(mem_read_block(CHUNK_INFO(prog_buf), sizeof(info), (uint8_t *)&info));
+    for (int i=0; i < OP_COUNT; i++) {
+        plan_now.op_count[i] += info.op_count[i];
+        plan_now.op_us[i] += info.op_us[i];
+        if (info.op_count[i] && info.op_us[i]) {
+            op_est_us[i] = ((op_est_us[i] * 3) + (info.op_us[i] / info.op_count[i])) / 4;
+        }
+    }
+    plan_now.erase_free += __builtin_popcount(info.noerase);
+    plan_now.verified += __builtin_popcount(info.verify_mask);
+    rc = SWD_OK;
+    for (int i=0; i < SECTORS_PER_CHUNK; i++) {
+        if ((info.verify_mask & (1 << i)) && info.verify[i] != prog_expect[i]) {
+            debug_printf("FLASH: verify failed at 0x%08x (0x%08x != 0x%08x)\r\n", prog_offset + (i * SECTOR_SIZE),
+                                                info.verify[i], prog_expect[i]);
+            rc = SWD_ERROR;
+        }
+    }
+    debug_printf("FLASH: plan 64K=%d 32K=%d 4K=%d pages=%d no-erase=0x%04x (erase %dms, program %dms)\r\n",
+                    info.op_count[OP_64K], info.op_count[OP_32K], info.op_count[OP_4K], info.op_count[OP_PAGE], info.noerase,
+                    (info.op_us[OP_4K] + info.op_us[OP_32K] + info.op_us[OP_64K]) / 1000, info.op_us[OP_PAGE] / 1000);
+    return rc;
+}
+
+/**
+ * @brief CRC a few of the sectors we think we know about, to make sure nobody
+ *        else has been writing to the flash (sector 0 always, if we know it)
+ */
+static int index_spot_check() {
+    uint32_t    r = time_us_32();
+    int         checked = 0;
+
+    for (int tries=0; tries < 64 && checked < INDEX_SPOT_CHECKS; tries++) {
+        uint32_t sector = tries ? (r = (r * 1103515245) + 12345) % FINDEX_SECTORS : 0;
+        uint32_t hash = findex_get(sector);
+        uint32_t crc;
+
+        if (hash == FINDEX_UNKNOWN) continue;
+        CHECK_OK(rp2040_crc32(FLASH_BASE + (sector * SECTOR_SIZE), SECTOR_SIZE, &crc));
+        if (crc != hash) {
+            debug_printf("FLASH: index doesn't match sector %d, not using it\r\n", sector);
+            return SWD_ERROR;
+        }
+        checked++;
+    }
+    return checked ? SWD_OK : SWD_ERROR;
+}
+
+/**
+ * @brief See if the saved index is for this flash (and still right), otherwise
+ *        start a new one. If the flash has no unique ID we don't use one at all.
+ */
+static void index_open() {
+    uint8_t     uid[FINDEX_UID_LEN];
+
+    index_checked = 1;
+    index_ok = 0;
+    if (flash_uid(uid) != SWD_OK) return;
+    if (findex_load(uid) != SWD_OK || index_spot_check() != SWD_OK) findex_reset(uid);
+    index_ok = 1;
+}
+
+/**
+ * @brief Fill in the hashes for the chunk at offset from the index, if we know
+ *        all of them
+ */
+static int index_get(uint32_t offset) {
+    uint32_t    h[SECTORS_PER_CHUNK];
+
+    for (int i=0; i < SECTORS_PER_CHUNK; i++) {
+        h[i] = findex_get(SECTOR_NUM(offset) + i);
+        if (h[i] == FINDEX_UNKNOWN) return 0;
+    }
+    memcpy(hashes, h, sizeof(hashes));
+    return 1;
+}
+
+/**
+ * @brief Get the sector hashes for the flash at offset (which has to wait for
+ *        any programming to finish)
+ * 
+ * @param offset 
+ * @return int 
+ */
+static int chunk_hash(uint32_t offset) {
+    if (hash_offset == offset) return SWD_OK;
+    hash_offset = HASH_NONE;
+
+    CHECK_OK(chunk_wait());
+    if (!index_checked) index_open();
+    if (index_ok && index_get(offset)) {
+        hash_offset = offset;
+        plan_now.index_chunks++;
+        return SWD_OK;
+    }
+    CHECK_OK(flash_copy_code());
+
+    uint32_t t = time_us_32();
+    uint32_t args[] = { offset, HASH_BUFFER, SECTORS_PER_CHUNK };
+    CHECK_OK(rp2040_call_function(TARGET_FUNC(flash_hash), args, sizeof(args)/sizeof(uint32_t)));
+    CHECK_OK(mem_read_block(HASH_BUFFER, sizeof(hashes), (uint8_t *)hashes));
+    hash_offset = offset;
+    flash_hashed = 1;
+    if (index_ok) {
+        for (int i=0; i < SECTORS_PER_CHUNK; i++) findex_set(SECTOR_NUM(offset) + i, hashes[i]);
+    }
+
+    debug_printf("FLASH: hashed 0x%08x in %dus\r\n", offset, time_us_32() - t);
+    return SWD_OK;
+}
+
+/**
+ * @brief Keep some incoming data on the probe (it must all be within the slots)
+ */
+static void sector_put(uint32_t offset, uint8_t *src, int len) {
+    while (len) {
+        int pos = offset % SECTOR_SIZE;
+        int count = MIN(len, SECTOR_SIZE - pos);
+        int slot = SLOT_NUM(offset);
+
+        if (slot_sector[slot] != SECTOR_NUM(offset) + 1) {
+            memset(sector_data[slot], 0xff, SECTOR_SIZE);
+            slot_sector[slot] = SECTOR_NUM(offset) + 1;
+        }
+        memcpy(sector_data[slot] + pos, src, count);
+        offset += count;
+        src += count;
+        len -= count;
+    }
+}
+
+/**
+ * @brief Forget what was put in the slots from offset to end (a bad packet), sectors
+ *        that started in there are dropped and the rest goes back to 0xff
+ */
+static void sector_forget(uint32_t offset, uint32_t end) {
+    while (offset < end) {
+        int pos = offset % SECTOR_SIZE;
+        int count = MIN(end - offset, SECTOR_SIZE - pos);
+        int slot = SLOT_NUM(offset);
+
+        if (slot_sector[slot] == SECTOR_NUM(offset) + 1) {
+            if (pos == 0) {
+                slot_sector[slot] = 0;
+            } else {
+                memset(sector_data[slot] + pos, 0xff, count);
+            }
+        }
+        offset += count;
+    }
+}
+
+/**
+ * @brief Work through the complete sectors of the current chunk, anything that
+ *        is different to the flash is sent to the target. If final is set then
+ *        any partial sector at the end is done as well (the rest of it is 0xff.)
+ * 
+ * @param final 
+ * @return int 
+ */
+static int chunk_process(int final) {
+    static uint8_t  lz_buf[SECTOR_SIZE];
+    int             limit = MIN(final ? SECTOR_CEIL(chunk_size) : chunk_size, CHUNK_SIZE);
+
+    while (chunk_done + SECTOR_SIZE <= limit) {
+        int         pos = chunk_done;
+        int         sector = pos / SECTOR_SIZE;
+        uint32_t    offset = chunk_start + pos;
+        int         slot = SLOT_NUM(offset);
+        uint8_t     *data = sector_data[slot];
+
+        chunk_done += SECTOR_SIZE;
+        chunk_crc[sector] = FINDEX_UNKNOWN;
+
+        // Nothing was written here, so it stays as it is
+        if (slot_sector[slot] != SECTOR_NUM(offset) + 1) continue;
+        slot_sector[slot] = 0;
+
+        flash_bytes_in += SECTOR_SIZE;
+        CHECK_OK(chunk_hash(chunk_start));
+        chunk_crc[sector] = crc32_update(0xffffffff, data, SECTOR_SIZE);
+        if (chunk_crc[sector] == hashes[sector]) {
+            chunk_mask &= ~(1 << sector);
+            continue;
+        }
+
+        // Send it compressed if we can...
+        int clen = lz_compress(data, SECTOR_SIZE, lz_buf, SECTOR_SIZE - LZ_MIN_SAVING);
+        if (clen) {
+            CHECK_OK(mem_write_block(CHUNK_BUFFER(chunk_buf) + pos + (SECTOR_SIZE - clen), clen, lz_buf));
+        } else {
+            CHECK_OK(mem_write_block(CHUNK_BUFFER(chunk_buf) + pos, SECTOR_SIZE, data));
+        }
+        flash_bytes_sent += clen ? clen : SECTOR_SIZE;
+        chunk_clen[sector] = clen;
+        chunk_mask |= (1 << sector);
+    }
+    return SWD_OK;
+}
+
+/**
+ * @brief Start a new chunk (if we don't have one) for data at offset, and process
+ *        everything before the sector it's in (GDB writes in order, so that's all
+ *        complete.)
+ */
+static int chunk_advance(uint32_t offset) {
+    if (!chunk_size) chunk_start = offset & ~(CHUNK_SIZE - 1);
+    chunk_size = MAX(chunk_size, SECTOR_FLOOR(offset) - chunk_start);
+    return chunk_process(0);
+}
+
+/**
+ * @brief The CRC of an erased sector (so we can spot them from the hashes)
+ */
+static uint32_t blank_crc() {
+    static uint32_t crc = 0;
+    uint8_t         ff[64];
+
+    if (!crc) {
+        memset(ff, 0xff, sizeof(ff));
+        crc = 0xffffffff;
+        for (int i=0; i < SECTOR_SIZE / sizeof(ff); i++) crc = crc32_update(crc, ff, sizeof(ff));
+    }
+    return crc;
+}
+
+// What it costs to put back sectors that get caught up in a bigger erase
+#define KEEP_COST(bits)     (__builtin_popcount(bits) * (SECTOR_SIZE / 256) * op_est_us[OP_PAGE])
+
+/**
+ * @brief Work out the cheapest way to erase a 32K block (at sector first), or
+ *        just return the cost if apply isn't set.
+ */
+static uint32_t plan_32k(struct chunk_info *info, int first, uint32_t need, uint32_t keepable, int apply) {
+    uint32_t    bits = 0xff << first;
+    uint32_t    cost4 = __builtin_popcount(need & bits) * op_est_us[OP_4K];
+    uint32_t    cost32 = op_est_us[OP_32K] + KEEP_COST(keepable & bits);
+    int         aligned = ((chunk_start + (first * SECTOR_SIZE)) % 32768) == 0;
+
+    if (!(need & bits)) return 0;
+    if (aligned && cost32 < cost4) {
+        if (apply) {
+            info->erase[first] = 8;
+            info->keep |= keepable & bits;
+        }
+        return cost32;
+    }
+    if (apply) {
+        for (int i=first; i < first + 8; i++) {
+            if (need & (1 << i)) info->erase[i] = 1;
+        }
+    }
+    return cost4;
+}
+
+/**
+ * @brief Build the erase plan for the current chunk
+ * 
+ * Changed sectors that are already blank just need programming, the rest need
+ * erasing with either 4K, 32K or 64K erases. A bigger erase takes out the
+ * unchanged sectors as well, so they have to be put back (which costs us some
+ * page programming.)
+ */
+static void chunk_plan(struct chunk_info *info) {
+    uint32_t    blank = 0;
+    uint32_t    need, keepable;
+
+    if (hash_offset == chunk_start) {
+        for (int i=0; i < SECTORS_PER_CHUNK; i++) {
+            if (hashes[i] == blank_crc()) blank |= (1 << i);
+        }
+    }
+    need = chunk_mask & ~blank;
+    keepable = ((1 << SECTORS_PER_CHUNK) - 1) & ~chunk_mask & ~blank;
+    plan_now.blank_skipped += __builtin_popcount(chunk_mask & blank);
+    rewriting = (__builtin_popcount(need) >= PRE_ERASE_MIN);
+
+    memset(info->erase, 0, sizeof(info->erase));
+    info->keep = 0;
+    if (!need) return;
+
+    if ((chunk_start % 65536) == 0) {
+        uint32_t cost64 = op_est_us[OP_64K] + KEEP_COST(keepable);
+        if (cost64 < plan_32k(info, 0, need, keepable, 0) + plan_32k(info, 8, need, keepable, 0)) {
+            info->erase[0] = 16;
+            info->keep = keepable;
+            return;
+        }
+    }
+    // 32K blocks where they fit (and are aligned), and 4K for the rest...
+    for (int i=0; i < SECTORS_PER_CHUNK; ) {
+        if (i + 8 <= SECTORS_PER_CHUNK && ((chunk_start + (i * SECTOR_SIZE)) % 32768) == 0) {
+            plan_32k(info, i, need, keepable, 1);
+            i += 8;
+            continue;
+        }
+        if (need & (1 << i)) info->erase[i] = 1;
+        i++;
+    }
+}
+
+/**
+ * @brief Which sectors of the chunk at offset has GDB asked to be erased
+ */
+static uint32_t erase_range_mask(uint32_t offset) {
+    uint32_t    mask = 0;
+
+    for (int i=0; i < SECTORS_PER_CHUNK; i++) {
+        uint32_t sector = offset + (i * SECTOR_SIZE);
+
+        for (int r=0; r < erase_range_count; r++) {
+            if (sector >= erase_ranges[r].start && sector + SECTOR_SIZE <= erase_ranges[r].end) mask |= (1 << i);
+        }
+    }
+    return mask;
+}
+
+/**
+ * @brief Plan erasing the next chunk at the end of this one (only if we are
+ *        rewriting most of the flash)
+ * 
+ * Only sectors GDB has asked to be erased that aren't already blank are done, a
+ * 32K or 64K erase is used if all of the block is in range and it's cheaper.
+ * The hashes are changed to blank so the next chunk sends (and plans) against
+ * what will be there.
+ */
+static void chunk_pre_plan(struct chunk_info *info, uint32_t next) {
+    uint32_t    in_range = erase_range_mask(next);
+    uint32_t    need = 0, done = 0;
+    uint32_t    cost[2];
+    int         use32[2];
+
+    if (hash_offset != next) return;
+    for (int i=0; i < SECTORS_PER_CHUNK; i++) {
+        if ((in_range & (1 << i)) && hashes[i] != blank_crc()) need |= (1 << i);
+    }
+    if (!need) return;
+
+    for (int h=0; h < 2; h++) {
+        uint32_t bits = 0xff << (h * 8);
+        int aligned = ((next + (h * 8 * SECTOR_SIZE)) % 32768) == 0;
+
+        cost[h] = __builtin_popcount(need & bits) * op_est_us[OP_4K];
+        use32[h] = (aligned && (in_range & bits) == bits && (need & bits) && op_est_us[OP_32K] < cost[h]);
+        if (use32[h]) cost[h] = op_est_us[OP_32K];
+    }
+    if ((next % 65536) == 0 && in_range == 0xffff && op_est_us[OP_64K] < cost[0] + cost[1]) {
+        info->pre_erase[0] = 16;
+        done = 0xffff;
+    } else {
+        for (int i=0; i < SECTORS_PER_CHUNK; i++) {
+            if (!(i % 8) && use32[i / 8]) {
+                info->pre_erase[i] = 8;
+                done |= 0xff << i;
+                i += 7;
+            } else if (need & (1 << i)) {
+                info->pre_erase[i] = 1;
+                done |= (1 << i);
+            }
+        }
+    }
+    info->pre_offset = next;
+    for (int i=0; i < SECTORS_PER_CHUNK; i++) {
+        if (done & (1 << i)) {
+            hashes[i] = blank_crc();
+            if (index_ok) findex_set(SECTOR_NUM(next) + i, blank_crc());
+        }
+    }
+    plan_now.pre_erased += __builtin_popcount(need);
+    debug_printf("FLASH: erasing 0x%08x ahead (0x%04x)\r\n", next, done);
+}
+
+/**
+ * @brief Called once the changed sectors are already on the target
+ * 
+ * This will copy over the code (if needed) and start the remote function, it
+ * doesn't wait for it to finish (see chunk_wait.)
+ * 
+ * @param offset 
+ * @param length 
+ * @return int 
+ */
+static int rp2040_program_flash_chunk(int offset, int length) {
+    int rc;
+
+    debug_printf("FLASH: Request to flash 0x%08x (len=%d, changed=0x%04x)\r\n", offset, length, chunk_mask);
+    if (!chunk_mask) {
+        rewriting = 0;
+        return 0;
+    }
+
+    // Only one at a time...
+    rc = chunk_wait();
+    if (rc != SWD_OK) return rc;
+
+    // Plan it while we still have the hashes for this bit...
+    static struct chunk_info info;      // (too big for the task stacks)
+    memset(&info, 0, sizeof(info));
+    info.mask = chunk_mask;
+    info.qpp = flash_qpp;
+    info.baudr = clock_boosted ? BOOST_BAUDR : 0;
+    memcpy(info.clen, chunk_clen, sizeof(info.clen));
+    chunk_plan(&info);
+
+    // If we are checking, this is what each sector should CRC to afterwards (we can't
+    // check ones we are keeping if we don't have the hashes)
+    if (flash_verify) {
+        for (int i=0; i < SECTORS_PER_CHUNK; i++) {
+            if ((chunk_mask & (1 << i)) && chunk_crc[i] != FINDEX_UNKNOWN) {
+                prog_expect[i] = chunk_crc[i];
+            } else if ((info.keep & (1 << i)) && hash_offset == offset) {
+                prog_expect[i] = hashes[i];
+            } else {
+                continue;
+            }
+            info.verify_mask |= (1 << i);
+        }
+    }
+
+    // The hashes for this bit won't be right after this, but we can get the next
+    // ones now (while the target is free) so the next chunk doesn't have to wait
+    if (hash_offset == offset) hash_offset = HASH_NONE;
+    if (length == CHUNK_SIZE) {
+        rc = chunk_hash(offset + CHUNK_SIZE);
+        if (rc != SWD_OK) return rc;
+        if (rewriting) chunk_pre_plan(&info, offset + CHUNK_SIZE);
+    }
+
+    rc = flash_copy_code();
+    if (rc != SWD_OK) return rc;
+
+    // If the hashes all came from the index then we still need boot2 copying...
+    if (!flash_hashed) {
+        uint32_t hargs[] = { offset, HASH_BUFFER, 0 };
+        rc = rp2040_call_function(TARGET_FUNC(flash_hash), hargs, sizeof(hargs)/sizeof(uint32_t));
+        if (rc != SWD_OK) return rc;
+        flash_hashed = 1;
+    }
+
+    rc = mem_write_block(CHUNK_INFO(chunk_buf), sizeof(info), (uint8_t *)&info);
+    if (rc != SWD_OK) return rc;
+
+    // This is what will be there (if it works)
+    if (index_ok) {
+        for (int i=0; i < SECTORS_PER_CHUNK; i++) {
+            if (chunk_mask & (1 << i)) findex_set(SECTOR_NUM(offset) + i, chunk_crc[i]);
+        }
+    }
+
+    uint32_t args[] = { offset, CHUNK_BUFFER(chunk_buf), length, CHUNK_INFO(chunk_buf) };
+    prog_start_time = time_us_32();
+    prog_offset = offset;
+    prog_buf = chunk_buf;
+    rc = rp2040_call_start(CODE_START, args, sizeof(args)/sizeof(uint32_t));
+    if (rc != SWD_OK) return rc;
+
+    prog_busy = 1;
+    return 0;
+}
+
+/**
+ * @brief Forget the current chunk (without programming it)
+ */
+static void chunk_reset() {
+    chunk_size = 0;
+    chunk_done = 0;
+    chunk_mask = 0;
+    memset(chunk_clen, 0, sizeof(chunk_clen));
+    memset(slot_sector, 0, sizeof(slot_sector));
+}
+
+/**
+ * @brief Program the current chunk (up to 64K) and move on to the next one, anything
+ *        that was streamed past the end is still in the sector slots so we deal with
+ *        that once we've moved on.
+ * 
+ * @return int 
+ */
+static int chunk_flush() {
+    int size = MIN(SECTOR_CEIL(chunk_size), CHUNK_SIZE);
+    int rc = chunk_process(1);
+
+    if (rc == SWD_OK) rc = rp2040_program_flash_chunk(chunk_start, size);
+
+    chunk_start += CHUNK_SIZE;
+    chunk_size = (chunk_size > CHUNK_SIZE) ? chunk_size - CHUNK_SIZE : 0;
+    chunk_buf = CHUNK_NEXT(chunk_buf);
+    chunk_done = 0;
+    chunk_mask = 0;
+    memset(chunk_clen, 0, sizeof(chunk_clen));
+    if (rc == SWD_OK && chunk_size) rc = chunk_process(0);
+    return rc;
+}
+
+/**
+ * @brief Add some data to the existing flash chunk
+ * 
+ * This will add data (sending the changed sectors to the target) up to 64k,
+ * then it will call rp2040_program_flash_chunk() to actually do the programming.
+ * 
+ * If we call this with a high offset and zero size then it will cause
+ * any residual chunk to be written out.
+ * 
+ * @param offset 
+ * @param src 
+ * @param size 
+ * @return int 
+ */
+int rp2040_add_flash_bit(uint32_t offset, uint8_t *src, int size) {
+    int rc;
+
+    debug_printf("FLASH: writing %d bytes to flash at 0x%08x\r\n", size, offset);
+
+
+    // If we are starting outside the range of an existing block (or going back over
+    // what we've already sent)...
+    if (chunk_size && (offset < chunk_start + chunk_done || offset >= (chunk_start + CHUNK_SIZE))) {
+        rc = chunk_flush();
+        chunk_reset();
+        if (rc != 0) {
+            flash_code_copied = 0;
+            return 1;
+        }
+    }
+
+    // If size is zero here then we are the last bit...
+    if (size == 0) {
+        flash_code_copied = 0;
+        return 0;
+    }
+
+    while (size) {
+        // Up to the end of the sector at a time...
+        int count = MIN(size, SECTOR_SIZE - (offset % SECTOR_SIZE));
+
+        // Keep it here, and send it over if it's changed...
+        uint32_t t = time_us_32();
+
+        rc = chunk_advance(offset);
+        if (rc == SWD_OK) {
+            sector_put(offset, src, count);
+            chunk_size = MAX(chunk_size, (offset + count) - chunk_start);
+            rc = chunk_process(0);
+        }
+        if (rc != SWD_OK) {
+            debug_printf("COPY FAILED: %d\r\n", rc);
+            return 1;;
+        }
+        debug_printf("FLASH: Processed %d bytes at 0x%08x (%d ms)\r\n", count, offset,
+                                                                            (time_us_32() - t)/1000);
+
+        // If we have a full one...
+        if (chunk_size >= CHUNK_SIZE) {
+            rc = chunk_flush();
+            if (rc != 0) return 1;
+        }
+
+        // Now process the remainder...
+        offset += count;
+        size -= count;
+        src += count;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------------
+// Write-behind queue
+// -----------------------------------------------------------------------------------
+//
+// GDB doesn't need to wait for the data to get to the target before it sends the
+// next vFlashWrite, so we hand the packet buffer (in place) to a separate task that
+// does the SWD transfer while the GDB task receives the next one into its other
+// buffer.
+//
+// There is only one slot, so by the time flash_queue_write() returns the previously
+// queued buffer is finished with and can be reused. Any error is remembered and
+// reported by flash_queue_done() (i.e. at vFlashDone.)
+//
+// The target may still be programming the last chunk when the slot is empty, so
+// anything else that wants to use SWD has to use flash_queue_wait() which waits for
+// that as well.
+//
+
+static uint32_t     wb_offset;
+static uint8_t      *wb_src;                // NULL means program the full chunk
+static int          wb_size;
+static int          wb_busy = 0;            // is the slot in use
+static int          wb_error = 0;
+
+static struct task  *wb_worker_waiting = NULL;
+static struct task  *wb_gdb_waiting = NULL;
+
+DEFINE_TASK(flashwb, 1024);
+
+static void func_flashwb(void *arg) {
+    int rc;
+
+    while (1) {
+        if (!wb_busy) {
+            wb_worker_waiting = current_task();
+            task_block();
+            continue;
+        }
+        // Once we've had an error we just drop everything until vFlashDone...
+        if (!wb_error) {
+            rc = wb_src ? rp2040_add_flash_bit(wb_offset, wb_src, wb_size) : chunk_flush();
+            if (rc != 0) {
+                debug_printf("FLASH: write-behind failed at 0x%08x\r\n", wb_offset);
+                wb_error = 1;
+            }
+        }
+        wb_busy = 0;
+        if (wb_gdb_waiting) {
+            task_wake(wb_gdb_waiting, 0);
+            wb_gdb_waiting = NULL;
+        }
+    }
+}
+
+static void wb_wait() {
+    while (wb_busy) {
+        wb_gdb_waiting = current_task();
+        task_block();
+    }
+}
+
+/**
+ * @brief Wait until the write-behind slot is empty and the target has finished
+ *        any programming (so the target is ours again.)
+ */
+void flash_queue_wait() {
+    wb_wait();
+    if (chunk_wait() != SWD_OK) wb_error = 1;
+}
+
+/**
+ * @brief Queue some data for writing, src must stay untouched until the next call
+ *        to flash_queue_write() or flash_queue_wait().
+ * 
+ * @param offset 
+ * @param src 
+ * @param size 
+ * @return int 
+ */
+int flash_queue_write(uint32_t offset, uint8_t *src, int size) {
+    wb_wait();
+
+    wb_offset = offset;
+    wb_src = src;
+    wb_size = size;
+    wb_busy = 1;
+    if (wb_worker_waiting) {
+        task_wake(wb_worker_waiting, 0);
+        wb_worker_waiting = NULL;
+    }
+    return 0;
+}
+
+/**
+ * @brief Remember a range GDB is going to write (vFlashErase), we don't erase
+ *        anything here, it just lets us erase ahead (see chunk_pre_plan)
+ * 
+ * @param offset 
+ * @param length 
+ * @return int 
+ */
+int flash_queue_erase(uint32_t offset, int length) {
+    if (erase_range_count && erase_ranges[erase_range_count - 1].end == offset) {
+        erase_ranges[erase_range_count - 1].end += length;
+        return 0;
+    }
+    if (erase_range_count == ERASE_RANGES) return 0;      // those just won't be done early
+    erase_ranges[erase_range_count].start = offset;
+    erase_ranges[erase_range_count].end = offset + length;
+    erase_range_count++;
+    return 0;
+}
+
+/**
+ * @brief Drain the queue and flush the last chunk, returns non-zero if anything
+ *        since the last call failed.
+ * 
+ * @return int 
+ */
+int flash_queue_done() {
+    int rc;
+
+    wb_wait();
+
+    // Don't program a partial chunk if something went wrong...
+    if (wb_error) chunk_reset();
+    rc = rp2040_add_flash_bit(0xffffffff, NULL, 0);
+    rc |= (chunk_wait() != SWD_OK) | wb_error;
+    rc |= (flash_clock_down() != SWD_OK);
+    wb_error = 0;
+
+    // Keep the index if it all worked, otherwise we don't know what's there
+    if (index_ok) {
+        if (rc) findex_forget(); else findex_save();
+    }
+    index_checked = index_ok = 0;
+    flash_hashed = 0;
+
+    // The flash could be changed by anything once we are done
+    hash_offset = HASH_NONE;
+
+    if (flash_bytes_in) {
+        debug_printf("FLASH: sent %d bytes over SWD for %d bytes of flash\r\n", flash_bytes_sent, flash_bytes_in);
+        plan_last = plan_now;
+    }
+    flash_bytes_in = flash_bytes_sent = 0;
+    memset(&plan_now, 0, sizeof(plan_now));
+    erase_range_count = 0;
+    rewriting = 0;
+    return rc;
+}
+
+// -----------------------------------------------------------------------------------
+// Streaming (cut-through) writes
+// -----------------------------------------------------------------------------------
+//
+// The GDB side sends us the payload of a vFlashWrite in blocks as it arrives, before
+// the checksum has been checked. We put it straight into the sector slots but don't
+// account for it (or send anything to the target) until the packet is committed, so
+// a bad packet is simply forgotten (see sector_forget.)
+//
+// A packet can run past the end of the current chunk, the excess stays in the slots
+// until we have moved on to the next chunk.
+//
+
+static uint32_t     st_offset;              // where the next streamed byte goes
+
+int flash_stream_begin(uint32_t offset) {
+    wb_wait();
+
+    // If we are starting outside the range of an existing block (or going back over
+    // what we've already sent)...
+    if (chunk_size && (offset < chunk_start + chunk_done || offset >= (chunk_start + CHUNK_SIZE))) {
+        int rc = chunk_flush();
+        chunk_reset();
+        if (rc != 0) return 1;
+    }
+    st_offset = offset;
+    return (chunk_advance(offset) != SWD_OK);
+}
+
+int flash_stream_data(uint8_t *src, int len) {
+    // Everything since the last processed sector has to fit in the slots
+    if ((st_offset + len) - (chunk_start + chunk_done) > SECTOR_SLOTS * SECTOR_SIZE) return 1;
+
+    sector_put(st_offset, src, len);
+    st_offset += len;
+    return 0;
+}
+
+/**
+ * @brief Finish a streamed packet, if commit is set then the data is good and we
+ *        account for it (sending any changed sectors, and programming the chunk in
+ *        the background if it's full), otherwise there is nothing to undo.
+ * 
+ * @param commit 
+ * @return int 
+ */
+int flash_stream_end(int commit) {
+    if (!commit) {
+        sector_forget(chunk_start + chunk_size, st_offset);
+        return 0;
+    }
+
+    chunk_size = MAX(chunk_size, st_offset - chunk_start);
+    if (chunk_process(0) != SWD_OK) return 1;
+    if (chunk_size >= CHUNK_SIZE) flash_queue_write(chunk_start, NULL, 0);
+    return 0;
+}
+
+/**
+ * @brief Lend out the sector slots while there's no flash data in them (streamed
+ *        X/M writes keep what they overwrite here), the caller must have done a
+ *        flash_queue_wait() and be finished with them before the next flash packet.
+ *
+ * @param size          set to how much there is
+ * @return uint8_t*     the space, or NULL if the slots are in use
+ */
+uint8_t *flash_scratch(uint32_t *size) {
+    for (int i=0; i < SECTOR_SLOTS; i++) {
+        if (slot_sector[i]) return NULL;
+    }
+    *size = sizeof(sector_data);
+    return (uint8_t *)sector_data;
+}
+
+/**
+ * @brief What the planner did for the last flash session, and the timings it uses
+ */
+static int mon_flash(char *args) {
+    struct plan_totals *p = &plan_last;
+
+    if (strcmp(args, "verify on") == 0 || strcmp(args, "verify off") == 0) {
+        flash_verify = (args[8] == 'n');
+        mon_printf("flash verify %s\n", flash_verify ? "on" : "off");
+        return SWD_OK;
+    }
+
+    mon_printf("flash.plan erase64k=%u erase32k=%u erase4k=%u pages=%u blank_skipped=%u erase_free=%u pre_erased=%u index_chunks=%u verified=%u erase_ms=%u program_ms=%u\n",
+                p->op_count[OP_64K], p->op_count[OP_32K], p->op_count[OP_4K], p->op_count[OP_PAGE], p->blank_skipped, p->erase_free,
+                p->pre_erased, p->index_chunks, p->verified,
+                (p->op_us[OP_4K] + p->op_us[OP_32K] + p->op_us[OP_64K]) / 1000, p->op_us[OP_PAGE] / 1000);
+    mon_printf("flash.clock boosted=%u before_khz=%u after_khz=%u\n", clock_khz[1] != clock_khz[0],
+                clock_khz[0], clock_khz[1]);
+    mon_printf("flash.model erase4k_us=%u erase32k_us=%u erase64k_us=%u page_us=%u page_cmd=0x%02x\n",
+                op_est_us[OP_4K], op_est_us[OP_32K], op_est_us[OP_64K], op_est_us[OP_PAGE], flash_qpp ? flash_qpp : 0x02);
+    return SWD_OK;
+}
+
+void flash_queue_init() {
+    CREATE_TASK(flashwb, func_flashwb, NULL);
+    monitor_register("flash", "[verify on|off] ... the erase plan for the last flash session and the timings it uses", mon_flash);
+}
+
+// -----------------------------------------------------------------------------------
+// Raw erase and program (no comparing) for the benchmarks
+// -----------------------------------------------------------------------------------
+
+FOR_TARGET int flash_raw(uint32_t offset, uint8_t *src, int length);
+
+/**
+ * @brief Where data to be programmed needs to be put on the target
+ */
+uint32_t rp2040_flash_buffer() {
+    return CHUNK_BUFFER(0);
+}
+
+static int flash_raw_call(uint32_t offset, uint32_t src, int length) {
+    CHECK_OK(flash_copy_code());
+
+    uint32_t args[] = { offset, src, length };
+    CHECK_OK(rp2040_call_function(TARGET_FUNC(flash_raw), args, sizeof(args)/sizeof(uint32_t)));
+    CHECK_OK(flash_clock_down());
+    findex_forget();
+
+    // The target code is only valid for this cycle, the next flashing will copy it again
+    flash_code_copied = 0;
+    hash_offset = HASH_NONE;
+    return SWD_OK;
+}
+
+/**
+ * @brief Erase a range of flash (offset and length 4K aligned)
+ */
+int rp2040_flash_erase(uint32_t offset, int length) {
+    return flash_raw_call(offset, 0, length);
+}
+
+/**
+ * @brief Program a range of flash (which must be erased) from rp2040_flash_buffer()
+ */
+int rp2040_flash_program(uint32_t offset, int length) {
+    return flash_raw_call(offset, rp2040_flash_buffer(), length);
+}
+
+// -----------------------------------------------------------------------------------
+// Small target helpers (CRC32, flash commands)
+// -----------------------------------------------------------------------------------
+//
+// These are for use outside of flashing, so they mustn't change anything on the
+// target. The routines (which have their own section) live at the start of SRAM5,
+// followed by a scratch area for passing data, and they run on the normal
+// call_function stack. All of those areas (and the core registers) are saved and
+// restored around the call.
+//
+
+#define HELPER_START        0x20041000
+#define HELPER_CODE_MAX     768
+#define HELPER_DATA         (HELPER_START + HELPER_CODE_MAX)
+#define HELPER_DATA_MAX     512
+#define HELPER_STACK_SIZE   256
+#define HELPER_STACK_BASE   (STACK_ADDDR - HELPER_STACK_SIZE)
+#define HELPER_REGS         19              // r0-r15, xpsr, msp, psp
+
+#define FOR_TARGET_HELPER   __attribute__((noinline, section("for_target_helper")))
+
+extern char __start_for_target_helper[];
+extern char __stop_for_target_helper[];
+
+#define HELPER_FUNC(f)      (HELPER_START + (((uint32_t)(f) & ~1) - (uint32_t)__start_for_target_helper))
+
+FOR_TARGET_HELPER uint32_t crc_block(uint8_t *addr, uint32_t len);
+FOR_TARGET_HELPER void flash_cmd(uint8_t *buf, int len, uint8_t *boot2);
+
+/**
+ * @brief Does the range addr..addr+len overlap with start..start+size
+ */
+static inline int overlaps(uint32_t addr, uint32_t len, uint32_t start, uint32_t size) {
+    return (addr < start + size) && (start < addr + len);
+}
+
+/**
+ * @brief Would a helper call trample on the range addr..addr+len
+ */
+static int helper_overlaps(uint32_t addr, uint32_t len) {
+    return overlaps(addr, len, HELPER_START, HELPER_CODE_MAX + HELPER_DATA_MAX)
+                        || overlaps(addr, len, HELPER_STACK_BASE, HELPER_STACK_SIZE);
+}
+
+/**
+ * @brief Are both cores halted? The helper stack is in the other core's stack
+ *        area (SCRATCH_X) and flash_cmd turns XIP off, so neither can be running.
+ */
+static int both_cores_halted() {
+    int cur = core_get();
+    int halted = 1;
+
+    for (int c=0; c < 2 && halted; c++) {
+        core_select(c);
+        halted = (core_is_halted() == 1);
+    }
+    core_select(cur);
+    return halted;
+}
+
+/**
+ * @brief Run a helper function on the target, leaving the target as it was
+ * 
+ * data (if given) is copied to HELPER_DATA before the call and back again
+ * afterwards. Both cores must be halted.
+ * 
+ * @param func      the helper (probe address)
+ * @param args 
+ * @param argc 
+ * @param data 
+ * @param data_len 
+ * @param result    r0 on return (can be NULL)
+ * @return int 
+ */
+static int helper_call(void *func, uint32_t args[], int argc, uint8_t *data, int data_len, uint32_t *result) {
+    static uint8_t  saved_code[HELPER_CODE_MAX + HELPER_DATA_MAX];
+    static uint8_t  saved_stack[HELPER_STACK_SIZE];
+    uint32_t        regs[HELPER_REGS];
+    int             code_len = (__stop_for_target_helper - __start_for_target_helper);
+    int             save_len = data_len ? HELPER_CODE_MAX + data_len : code_len;
+    int             rc;
+
+    assert(code_len <= HELPER_CODE_MAX && data_len <= HELPER_DATA_MAX);
+    if (!both_cores_halted()) return SWD_ERROR;
+
+    // Keep everything we are about to trample on...
+    for (int i=0; i < HELPER_REGS; i++) CHECK_OK(reg_read(i, &regs[i]));
+    CHECK_OK(mem_read_block(HELPER_START, save_len, saved_code));
+    CHECK_OK(mem_read_block(HELPER_STACK_BASE, HELPER_STACK_SIZE, saved_stack));
+
+    rc = mem_write_block(HELPER_START, code_len, (uint8_t *)__start_for_target_helper);
+    if (rc == SWD_OK && data_len) rc = mem_write_block(HELPER_DATA, data_len, data);
+    if (rc == SWD_OK) rc = rp2040_call_function(HELPER_FUNC(func), args, argc);
+    if (rc == SWD_OK && result) rc = reg_read(0, result);
+    if (rc == SWD_OK && data_len) rc = mem_read_block(HELPER_DATA, data_len, data);
+
+    // Put it all back (even if something failed)
+    CHECK_OK(mem_write_block(HELPER_START, save_len, saved_code));
+    CHECK_OK(mem_write_block(HELPER_STACK_BASE, HELPER_STACK_SIZE, saved_stack));
+    for (int i=0; i < HELPER_REGS; i++) CHECK_OK(reg_write(i, regs[i]));
+    return rc;
+}
+
+//
+// GDB uses a non-reflected CRC32 (polynomial 0x04c11db7, initial value 0xffffffff and
+// no final xor) which is exactly what the RP2040 DMA sniffer calculates, so we use a
+// tiny routine on the target that uses it (or a bit loop if it can't) and just read
+// back the result. If the range covers the helper areas, a core isn't halted, or
+// there are software breakpoints in it (which GDB doesn't see in its reads), then we
+// read the memory over SWD and calculate it here.
+//
+
+#define CRC_BLOCK           1024
+
+/**
+ * @brief Table driven CRC32 on the probe (same flavour as the DMA sniffer)
+ */
+static uint32_t crc32_update(uint32_t crc, uint8_t *buf, int len) {
+    static uint32_t table[256];
+
+    if (!table[1]) {
+        for (int i=0; i < 256; i++) {
+            uint32_t v = i << 24;
+            for (int b=0; b < 8; b++) v = (v & 0x80000000) ? (v << 1) ^ 0x04c11db7 : (v << 1);
+            table[i] = v;
+        }
+    }
+    while (len--) crc = (crc << 8) ^ table[(crc >> 24) ^ *buf++];
+    return crc;
+}
+
 /**
- * @brief Called once the block is already on the target
- * 
- * This will copy over the code (if needed) and execute the remote function
+ * @brief Calculate the CRC over a block of target memory on the probe, this
+ *        is the fallback (and much slower) version.
  * 
- * @param offset 
- * @param length 
+ * @param addr 
+ * @param len 
+ * @param crc 
  * @return int 
  */
-static int rp2040_program_flash_chunk(int offset, int length) {
-    extern char __start_for_target[];
-    extern char __stop_for_target[];
-    int rc;
+static int crc32_on_probe(uint32_t addr, uint32_t len, uint32_t *crc) {
+    static uint8_t  buf[CRC_BLOCK];
+    uint32_t        c = 0xffffffff;
 
-    debug_printf("FLASH: Request to flash 0x%08x (len=%d)\r\n", offset, length);
+    while (len) {
+        int size = MIN(len, CRC_BLOCK);
+        CHECK_OK(mem_read_block(addr, size, buf));
+        bp_hide(addr, size, buf);
+        c = crc32_update(c, buf, size);
+        addr += size;
+        len -= size;
+    }
+    *crc = c;
+    return SWD_OK;
+}
 
-    // Copy the code over ... only needed once per flashing cycle...
+/**
+ * @brief Calculate a GDB compatible CRC32 of a block of target memory
+ * 
+ * Where we can, this runs on the target (using the DMA sniffer) so only the
+ * result comes back over SWD.
+ * 
+ * @param addr 
+ * @param len 
+ * @param crc 
+ * @return int 
+ */
+int rp2040_crc32(uint32_t addr, uint32_t len, uint32_t *crc) {
+    uint32_t    args[] = { addr, len };
+    int         rc;
 
-    if (!flash_code_copied) {
-        int code_len = (__stop_for_target - __start_for_target);
-        debug_printf("FLASH: Copying custom flash code to 0x%08x (%d bytes)\r\n", CODE_START, code_len);
-        rc = mem_write_block(CODE_START, code_len, (uint8_t *)__start_for_target);
-        if (rc != SWD_OK) return rc;
-        flash_code_copied = 1;
+    if (!len) {
+        *crc = 0xffffffff;
+        return SWD_OK;
+    }
+    if (!both_cores_halted() || helper_overlaps(addr, len) || bp_hidden_in(addr, len)) {
+        return crc32_on_probe(addr, len, crc);
     }
 
     uint32_t t = time_us_32();
+    rc = helper_call(crc_block, args, 2, NULL, 0, crc);
+    debug_printf("CRC: 0x%08x (len=%d) took %dus\r\n", addr, len, time_us_32() - t);
+    return rc;
+}
 
-    uint32_t args[] = { offset, DATA_BUFFER, length };
-    rc = rp2040_call_function(CODE_START, args, sizeof(args)/sizeof(uint32_t));
-    if (rc != SWD_OK) return rc;
+//
+// Flash identification ... the JEDEC ID and SFDP tables are read by sending
+// commands to the flash directly (flash_cmd) which gives us the real size and
+// the erase sizes it supports.
+//
 
-    uint32_t r0, erased, programmed;
-    rc = reg_read(0, &r0);
+#define FLASH_DEFAULT_SIZE  (2 * 1024 * 1024)
+#define FLASH_DEFAULT_BLOCK 4096
+#define SFDP_HDR_LEN        16              // SFDP header and the first (BFPT) parameter header
+#define SFDP_BFPT_DWORDS    9               // enough to get the erase types
+#define BOOT2_SIZE          256
 
-    erased = (r0 >> 24) * 4;
-    programmed = r0 & 0x00ffffff;
+/**
+ * @brief Send a command to the flash (and get the response in the same buffer)
+ * 
+ * If XIP was already set up (i.e. something has run) then the boot2 from the
+ * start of flash is used to put it back the same way afterwards.
+ */
+static int flash_command(uint8_t *buf, int len) {
+    static uint8_t  data[BOOT2_SIZE + SFDP_BFPT_DWORDS * 4 + 8];
+    uint32_t        pc;
+    int             boot2 = 0;
+
+    assert(len <= sizeof(data) - BOOT2_SIZE);
+    CHECK_OK(reg_read(15, &pc));
+    if (pc >= 0x00004000) {
+        // We are out of the bootrom, so XIP should be working...
+        boot2 = (mem_read_block(FLASH_BASE, BOOT2_SIZE, data + len) == SWD_OK);
+    }
+    memcpy(data, buf, len);
+
+    uint32_t args[] = { HELPER_DATA, len, boot2 ? HELPER_DATA + len : 0 };
+    CHECK_OK(helper_call(flash_cmd, args, 3, data, len + (boot2 ? BOOT2_SIZE : 0), NULL));
+    memcpy(buf, data, len);
+    return SWD_OK;
+}
 
-    debug_printf("FLASH: Erased %dk and programmed %d bytes in %dms\r\n", erased, programmed, (time_us_32() - t)/1000);
+static int sfdp_read(uint32_t addr, uint8_t *dest, int len) {
+    uint8_t buf[5 + SFDP_BFPT_DWORDS * 4];
 
-    return 0;
+    assert(len <= SFDP_BFPT_DWORDS * 4);
+    memset(buf, 0, sizeof(buf));
+    buf[0] = 0x5a;
+    buf[1] = addr >> 16;
+    buf[2] = addr >> 8;
+    buf[3] = addr;
+    CHECK_OK(flash_command(buf, 5 + len));          // 1 dummy byte
+    memcpy(dest, buf + 5, len);
+    return SWD_OK;
+}
+
+static inline uint32_t le32(uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
 }
 
 /**
- * @brief Add some data to the existing flash chunk
- * 
- * This will add data (and copy it to the target) up to 64k, then it will
- * call rp2040_program_flash_chunk() to actually do the programming.
+ * @brief Find the size of the flash and the smallest erase size it supports
  * 
- * If we call this with a high offset and zero size then it will cause
- * any residual chunk to be written out.
+ * Uses SFDP if the flash has it, otherwise the JEDEC capacity byte. If we
+ * can't talk to it at all then we return the defaults (2MB with 4K erase)
+ * and an error.
  * 
- * @param offset 
- * @param src 
  * @param size 
+ * @param blocksize 
  * @return int 
  */
-static uint32_t     chunk_start = 0;        // flash address of the start
-static uint32_t     chunk_size = 0;         // how much is already done
+int rp2040_flash_info(uint32_t *size, uint32_t *blocksize) {
+    uint8_t     jedec[4] = { 0x9f, 0, 0, 0 };
+    uint8_t     hdr[SFDP_HDR_LEN];
+    uint8_t     bfpt[SFDP_BFPT_DWORDS * 4];
 
-int rp2040_add_flash_bit(uint32_t offset, uint8_t *src, int size) {
-    int rc;
+    *size = FLASH_DEFAULT_SIZE;
+    *blocksize = FLASH_DEFAULT_BLOCK;
 
-    debug_printf("FLASH: writing %d bytes to flash at 0x%08x\r\n", size, offset);
+    flash_queue_wait();
+    CHECK_OK(flash_command(jedec, sizeof(jedec)));
+    debug_printf("FLASH: JEDEC id %02x %02x %02x\r\n", jedec[1], jedec[2], jedec[3]);
+    if (jedec[3] >= 16 && jedec[3] <= 28) *size = 1 << jedec[3];
 
+    CHECK_OK(sfdp_read(0, hdr, sizeof(hdr)));
+    if (memcmp(hdr, "SFDP", 4) == 0) {
+        uint32_t ptr = hdr[12] | (hdr[13] << 8) | (hdr[14] << 16);
+        int dwords = MIN(hdr[11], SFDP_BFPT_DWORDS);
 
-    // If we are starting outside the range of an existing block...
-    if (chunk_size && (offset >= (chunk_start + 65536))) {
-        rp2040_program_flash_chunk(chunk_start, chunk_size);
-        chunk_size = 0;
+        CHECK_OK(sfdp_read(ptr, bfpt, dwords * 4));
+        if (dwords >= 2) {
+            uint32_t density = le32(bfpt + 4);
+            uint64_t bits = (density & 0x80000000) ? ((uint64_t)1 << (density & 0x7fffffff))
+                                                   : (uint64_t)density + 1;
+            *size = bits / 8;
+        }
+        if (dwords >= 9) {
+            // Erase types 1-4 (size is 2^N, zero means not there)
+            uint32_t smallest = 0;
+            for (int i=0; i < 4; i++) {
+                int n = bfpt[28 + (i * 2)];
+                if (n && (!smallest || (1u << n) < smallest)) smallest = 1 << n;
+            }
+            if (smallest) *blocksize = smallest;
+        } else if ((le32(bfpt) & 3) == 1) {
+            *blocksize = 4096;
+        }
     }
+    debug_printf("FLASH: size %d, erase block %d\r\n", *size, *blocksize);
+    return SWD_OK;
+}
 
-    // If size is zero here then we are the last bit...
-    if (size == 0) {
-        flash_code_copied = 0;
-        return 0;
+/**
+ * @brief Read the unique ID of the flash (0x4B), it's an error if there isn't
+ *        one (all zeros or all ones)
+ */
+static int flash_uid(uint8_t *uid) {
+    uint8_t     buf[5 + FINDEX_UID_LEN] = { 0x4b };     // 4 dummy bytes first
+    uint8_t     all = 0xff, any = 0;
+
+    CHECK_OK(flash_command(buf, sizeof(buf)));
+    memcpy(uid, buf + 5, FINDEX_UID_LEN);
+    for (int i=0; i < FINDEX_UID_LEN; i++) {
+        all &= uid[i];
+        any |= uid[i];
     }
+    return (any && all != 0xff) ? SWD_OK : SWD_ERROR;
+}
 
-    while (size) {
-        // If we are a new chunk...
-        if (chunk_size == 0) {
-            chunk_start = offset;
-        }
-        // Now how much can we fit in...
-        int space = 65536 - chunk_size;
-        int count = MIN(space, size);
+/**
+ * @brief See if the flash can do a quad page program (and is set up for it)
+ * 
+ * We only use it on parts we know about, and only if the quad enable bit is
+ * already set (boot2 normally does this) and SFDP (if it's there) agrees the
+ * part can do quad. Anything else uses the normal ROM page program.
+ * 
+ * @return uint32_t     the command to use, or 0
+ */
+static uint32_t flash_quad_detect() {
+    static const struct {
+        uint8_t     mfr;
+        uint8_t     cmd;            // 0x32 is 1-1-4, 0x38 is 1-4-4
+        uint8_t     qe_cmd;         // status register with the QE bit
+        uint8_t     qe_bit;
+    } parts[] = {
+        { 0xef, 0x32, 0x35, 1 },    // Winbond
+        { 0xc8, 0x32, 0x35, 1 },    // GigaDevice
+        { 0xc2, 0x38, 0x05, 6 },    // Macronix
+    };
+    uint8_t     jedec[4] = { 0x9f, 0, 0, 0 };
+    uint8_t     hdr[SFDP_HDR_LEN];
+    uint8_t     bfpt[4];
 
-        // Let's copy it over...
-        uint32_t t = time_us_32();
+    if (flash_command(jedec, sizeof(jedec)) != SWD_OK) return 0;
+    for (int i=0; i < sizeof(parts)/sizeof(parts[0]); i++) {
+        uint8_t status[2] = { parts[i].qe_cmd, 0 };
 
-        rc = mem_write_block(DATA_BUFFER + (offset - chunk_start), count, src);
-        if (rc != SWD_OK) {
-            debug_printf("COPY FAILED: %d\r\n", rc);
-            return 1;;
-        }
-        debug_printf("FLASH: Copied %d bytes to location 0x%08x (%d ms)\r\n", count, DATA_BUFFER+(offset-chunk_start),
-                                                                            (time_us_32() - t)/1000);
-        chunk_size += count;
+        if (parts[i].mfr != jedec[1]) continue;
 
-        // If we have a full one...
-        if (chunk_size == 65536) {
-            rp2040_program_flash_chunk(chunk_start, chunk_size);
-            chunk_size = 0;
+        // SFDP DWORD 1, bit 22 is 1-1-4 fast read and bit 21 is 1-4-4
+        if (sfdp_read(0, hdr, sizeof(hdr)) != SWD_OK) return 0;
+        if (memcmp(hdr, "SFDP", 4) == 0) {
+            if (sfdp_read(hdr[12] | (hdr[13] << 8) | (hdr[14] << 16), bfpt, 4) != SWD_OK) return 0;
+            if (!(le32(bfpt) & ((parts[i].cmd == 0x38) ? (1 << 21) : (1 << 22)))) break;
         }
-
-        // Now process the remainder...
-        offset += count;
-        size -= count;
-        src += count;
+        if (flash_command(status, sizeof(status)) != SWD_OK) return 0;
+        if (!(status[1] & (1 << parts[i].qe_bit))) {
+            debug_printf("FLASH: quad enable isn't set, using single lane page program\r\n");
+            return 0;
+        }
+        debug_printf("FLASH: using quad page program (0x%02x)\r\n", parts[i].cmd);
+        return parts[i].cmd;
     }
     return 0;
 }
@@ -163,9 +1501,13 @@ int rp2040_add_flash_bit(uint32_t offset, uint8_t *src, int size) {
 //
 // Memory Map on target for programming:
 //
-// 0x2000 0000      64K incoming data buffer
-// 0x2001 0000      start of code
-// 0x2002 0000      stage2 bootloader copy
+// 0x2000 0000      2 x 64K incoming data buffers
+// 0x2002 0000      4K scratch for reading the flash (flash_block)
+// 0x2003 0000      start of code
+// 0x2003 f000      stage2 bootloader copy
+// 0x2003 f100      sector hashes (flash_hash)
+// 0x2003 f200      chunk info for each data buffer (the plan for each chunk)
+// 0x2003 f400      saved clock setup (clock_boost)
 // 0x2004 0800      top of stack 
 //
 
@@ -178,7 +1520,267 @@ typedef void *(*rom_void_fn)(void);
 typedef void *(*rom_flash_erase_fn)(uint32_t addr, size_t count, uint32_t block_size, uint8_t block_cmd);
 typedef void *(*rom_flash_prog_fn)(uint32_t addr, const uint8_t *data, size_t count);
 
-FOR_TARGET int flash_block(uint32_t offset, uint8_t *src, int length) {
+#define DMA_BASE            0x50000000
+#define DMA_CRC_CHAN        11
+#define DMA_SNIFF_CTRL      (DMA_BASE + 0x434)
+#define DMA_SNIFF_DATA      (DMA_BASE + 0x438)
+#define RESETS_DONE         0x4000c008
+#define RESETS_DMA          (1 << 2)
+
+#define DMA_CTRL_EN         (1 << 0)
+#define DMA_CTRL_INCR_READ  (1 << 4)
+#define DMA_CTRL_CHAIN_SELF (DMA_CRC_CHAN << 11)
+#define DMA_CTRL_UNPACED    (0x3f << 15)
+#define DMA_CTRL_IRQ_QUIET  (1 << 21)
+#define DMA_CTRL_SNIFF_EN   (1 << 23)
+#define DMA_CTRL_BUSY       (1 << 24)
+
+/**
+ * @brief CRC32 (the GDB/boot2 flavour) of a block of target memory, using the
+ *        DMA sniffer if we can, this is inlined into both sections.
+ */
+static inline __attribute__((always_inline)) uint32_t dma_crc32(uint8_t *addr, uint32_t len) {
+    volatile uint32_t   *ch = (volatile uint32_t *)(DMA_BASE + (DMA_CRC_CHAN * 0x40));
+    volatile uint32_t   *sniff_ctrl = (volatile uint32_t *)DMA_SNIFF_CTRL;
+    volatile uint32_t   *sniff_data = (volatile uint32_t *)DMA_SNIFF_DATA;
+    uint32_t            crc = 0xffffffff;
+
+    // If the DMA block is out of reset and our channel isn't in use then let the
+    // sniffer do the work (CALC=0 is the non-reflected CRC32 that GDB uses)
+    if ((*(volatile uint32_t *)RESETS_DONE & RESETS_DMA) && !(ch[3] & (DMA_CTRL_EN | DMA_CTRL_BUSY))) {
+        uint32_t            read_addr = ch[0], write_addr = ch[1], count = ch[2], ctrl = ch[3];
+        uint32_t            old_sniff_ctrl = *sniff_ctrl, old_sniff_data = *sniff_data;
+        volatile uint32_t   dummy;
+
+        *sniff_data = 0xffffffff;
+        *sniff_ctrl = 1 | (DMA_CRC_CHAN << 1);
+        ch[0] = (uint32_t)addr;
+        ch[1] = (uint32_t)&dummy;
+        ch[2] = len;
+        ch[3] = DMA_CTRL_EN | DMA_CTRL_INCR_READ | DMA_CTRL_CHAIN_SELF | DMA_CTRL_UNPACED
+                            | DMA_CTRL_IRQ_QUIET | DMA_CTRL_SNIFF_EN;      // byte transfers
+        while (ch[3] & DMA_CTRL_BUSY);
+        crc = *sniff_data;
+
+        // Put the channel back as we found it (ch[4] is the non-triggering ctrl alias)
+        ch[4] = ctrl;
+        ch[0] = read_addr;
+        ch[1] = write_addr;
+        ch[2] = count;
+        *sniff_data = old_sniff_data;
+        *sniff_ctrl = old_sniff_ctrl;
+        return crc;
+    }
+
+    while (len--) {
+        crc ^= (uint32_t)(*addr++) << 24;
+        for (int i=0; i < 8; i++) {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+#define XIP_CTRL_STAT       0x14000008
+#define XIP_STAT_FIFO_EMPTY (1 << 1)
+#define XIP_STREAM_ADDR     0x14000014
+#define XIP_STREAM_CTR      0x14000018
+#define XIP_STREAM_FIFO     0x1400001c
+#define XIP_AUX_BASE        0x50400000          // fast (AHB) alias of XIP_STREAM_FIFO
+#define DREQ_XIP_STREAM     37
+#define DMA_CTRL_SIZE_WORD  (2 << 2)
+#define DMA_CTRL_INCR_WRITE (1 << 5)
+#define DMA_CTRL_TREQ(n)    ((n) << 15)
+#define DMA_SNIFF_BSWAP     (1 << 9)
+#define STREAM_NONE         0xffffffff
+
+/**
+ * @brief CRC32 a (word aligned) bit of flash by having the XIP block stream it
+ *        straight from the flash into the DMA, this goes round the cache so it's
+ *        what's really in the flash, and we can take a copy at the same time if
+ *        dst is set. XIP needs to be on.
+ *
+ * We only use this while flashing, when the DMA is ours (see flash_hash), but we
+ * still leave the channel and sniffer as we found them, like dma_crc32.
+ */
+static inline __attribute__((always_inline)) uint32_t xip_stream_crc32(uint32_t addr, uint32_t len, uint32_t *dst, uint32_t sniff_flags) {
+    volatile uint32_t   *ch = (volatile uint32_t *)(DMA_BASE + (DMA_CRC_CHAN * 0x40));
+    volatile uint32_t   *sniff_ctrl = (volatile uint32_t *)DMA_SNIFF_CTRL;
+    volatile uint32_t   *sniff_data = (volatile uint32_t *)DMA_SNIFF_DATA;
+    uint32_t            read_addr = ch[0], write_addr = ch[1], count = ch[2], ctrl = ch[3];
+    uint32_t            old_sniff_ctrl = *sniff_ctrl, old_sniff_data = *sniff_data;
+    uint32_t            crc;
+    volatile uint32_t   dummy;
+
+    // Stop anything that was already going and empty the fifo
+    *(volatile uint32_t *)XIP_STREAM_CTR = 0;
+    while (!(*(volatile uint32_t *)XIP_CTRL_STAT & XIP_STAT_FIFO_EMPTY)) dummy = *(volatile uint32_t *)XIP_STREAM_FIFO;
+
+    *sniff_data = 0xffffffff;
+    *sniff_ctrl = 1 | (DMA_CRC_CHAN << 1) | sniff_flags;
+    ch[0] = XIP_AUX_BASE;
+    ch[1] = dst ? (uint32_t)dst : (uint32_t)&dummy;
+    ch[2] = len / 4;
+    ch[3] = DMA_CTRL_EN | DMA_CTRL_SIZE_WORD | (dst ? DMA_CTRL_INCR_WRITE : 0) | DMA_CTRL_CHAIN_SELF
+                        | DMA_CTRL_TREQ(DREQ_XIP_STREAM) | DMA_CTRL_IRQ_QUIET | DMA_CTRL_SNIFF_EN;
+
+    *(volatile uint32_t *)XIP_STREAM_ADDR = addr;
+    *(volatile uint32_t *)XIP_STREAM_CTR = len / 4;
+    while (ch[3] & DMA_CTRL_BUSY);
+    crc = *sniff_data;
+
+    // Put the channel back, disabled, without triggering it (ch[4] is the
+    // non-triggering ctrl alias) and the sniffer as it was
+    ch[4] = ctrl & ~DMA_CTRL_EN;
+    ch[0] = read_addr;
+    ch[1] = write_addr;
+    ch[2] = count;
+    *sniff_data = old_sniff_data;
+    *sniff_ctrl = old_sniff_ctrl;
+    return crc;
+}
+
+/**
+ * @brief See if we can use xip_stream_crc32, and if so the sniff flags it needs
+ *
+ * The sniffer takes a word transfer least significant byte first, but the CRC32
+ * works through it from the top, so we need BSWAP to get the same answer as
+ * dma_crc32 does with byte transfers.
+ *
+ * @return uint32_t     the sniff flags to use, or STREAM_NONE
+ */
+static inline __attribute__((always_inline)) uint32_t xip_stream_mode() {
+    volatile uint32_t   *ch = (volatile uint32_t *)(DMA_BASE + (DMA_CRC_CHAN * 0x40));
+
+    if (!(*(volatile uint32_t *)RESETS_DONE & RESETS_DMA) || (ch[3] & (DMA_CTRL_EN | DMA_CTRL_BUSY))) return STREAM_NONE;
+    return DMA_SNIFF_BSWAP;
+}
+
+#define IO_QSPI_SS_CTRL     0x4001800c
+#define SS_OUTOVER_LOW      (2 << 8)
+#define SS_OUTOVER_HIGH     (3 << 8)
+#define SSI_CTRLR0          0x18000000
+#define SSI_SSIENR          0x18000008
+#define SSI_BAUDR           0x18000014
+#define SSI_SR              0x18000028
+#define SSI_DR0             0x18000060
+#define SSI_SPI_CTRLR0      0x180000f4
+#define SSI_SR_BUSY         (1 << 0)
+#define SSI_SR_TFNF         (1 << 1)
+#define SSI_SR_TFE          (1 << 2)
+#define SSI_SR_RFNE         (1 << 3)
+#define SSI_CTRLR0_QUAD_TX  ((2 << 21) | (31 << 16) | (1 << 8))    // quad, 32 bit frames, tx only
+#define SSI_SPI_ADDR_QUAD   (1 << 0)                                // TRANS_TYPE (address on 4 lines)
+#define SSI_SPI_ADDR_24     (6 << 2)
+#define SSI_SPI_INST_8      (2 << 8)
+#define QPP_MIN_BAUDR       4           // so we can keep the fifo full
+
+/**
+ * @brief Standard SPI transfer to the flash (XIP needs to be off), the response
+ *        replaces what was sent, this is inlined into both sections.
+ */
+static inline __attribute__((always_inline)) void ssi_xfer(uint8_t *buf, int len) {
+    volatile uint32_t   *ss_ctrl = (volatile uint32_t *)IO_QSPI_SS_CTRL;
+    volatile uint32_t   *sr = (volatile uint32_t *)SSI_SR;
+    volatile uint32_t   *dr = (volatile uint32_t *)SSI_DR0;
+    int                 tx = 0, rx = 0;
+
+    // Same as the SDK flash_do_cmd, chip select is forced low for the whole thing
+    // and we keep the fifo topped up (but never more than 14 in flight)
+    *ss_ctrl = (*ss_ctrl & ~(3 << 8)) | SS_OUTOVER_LOW;
+    while (rx < len) {
+        if (tx < len && (*sr & SSI_SR_TFNF) && (tx - rx) < 14) *dr = buf[tx++];
+        if (*sr & SSI_SR_RFNE) buf[rx++] = *dr;
+    }
+    *ss_ctrl = (*ss_ctrl & ~(3 << 8)) | SS_OUTOVER_HIGH;
+    *ss_ctrl = (*ss_ctrl & ~(3 << 8));
+}
+
+/**
+ * @brief Page program using all four data lines (cmd is 0x32 or 0x38), the
+ *        same as the ROM flash_range_program otherwise.
+ * 
+ * The SSI ends a tx only transfer as soon as the fifo runs dry, so interrupts
+ * are off and the clock is slowed (if needed) to make sure we keep up.
+ */
+static inline __attribute__((always_inline)) void qspi_program(uint32_t addr, uint8_t *data, int len, uint32_t cmd) {
+    volatile uint32_t   *ss_ctrl = (volatile uint32_t *)IO_QSPI_SS_CTRL;
+    volatile uint32_t   *ctrlr0 = (volatile uint32_t *)SSI_CTRLR0;
+    volatile uint32_t   *ssienr = (volatile uint32_t *)SSI_SSIENR;
+    volatile uint32_t   *baudr = (volatile uint32_t *)SSI_BAUDR;
+    volatile uint32_t   *spi_ctrlr0 = (volatile uint32_t *)SSI_SPI_CTRLR0;
+    volatile uint32_t   *sr = (volatile uint32_t *)SSI_SR;
+    volatile uint32_t   *dr = (volatile uint32_t *)SSI_DR0;
+    uint32_t            old_ctrlr0 = *ctrlr0, old_spi_ctrlr0 = *spi_ctrlr0, old_baudr = *baudr;
+    uint32_t            primask;
+
+    __asm volatile ("mrs %0, primask\n cpsid i" : "=r" (primask));
+    while (len > 0) {
+        int         n = MIN(len, 256 - (addr & 255));
+        uint8_t     cmdbuf[2] = { 0x06, 0 };        // write enable
+
+        ssi_xfer(cmdbuf, 1);
+
+        *ssienr = 0;
+        *ctrlr0 = SSI_CTRLR0_QUAD_TX;
+        *spi_ctrlr0 = ((cmd == 0x38) ? SSI_SPI_ADDR_QUAD : 0) | SSI_SPI_ADDR_24 | SSI_SPI_INST_8;
+        *baudr = MAX(old_baudr, QPP_MIN_BAUDR);
+        *ssienr = 1;
+
+        *ss_ctrl = (*ss_ctrl & ~(3 << 8)) | SS_OUTOVER_LOW;
+        *dr = cmd;
+        *dr = addr & 0x00ffffff;
+        for (int i=0; i < n; i += 4) {
+            uint32_t w = 0xffffffff;        // padding with 0xff doesn't program anything
+
+            if (i + 4 <= n) {
+                w = __builtin_bswap32(*(uint32_t *)(data + i));
+            } else {
+                for (int b=0; b < 4; b++) w = (w << 8) | ((i + b < n) ? data[i + b] : 0xff);
+            }
+            while (!(*sr & SSI_SR_TFNF));
+            *dr = w;
+        }
+        while ((*sr & (SSI_SR_TFE | SSI_SR_BUSY)) != SSI_SR_TFE);
+        *ss_ctrl = (*ss_ctrl & ~(3 << 8)) | SS_OUTOVER_HIGH;
+        *ss_ctrl = (*ss_ctrl & ~(3 << 8));
+
+        *ssienr = 0;
+        *ctrlr0 = old_ctrlr0;
+        *spi_ctrlr0 = old_spi_ctrlr0;
+        *baudr = old_baudr;
+        *ssienr = 1;
+
+        // Wait for the write in progress bit to clear...
+        do {
+            cmdbuf[0] = 0x05;
+            ssi_xfer(cmdbuf, 2);
+        } while (cmdbuf[1] & 1);
+
+        addr += n;
+        data += n;
+        len -= n;
+    }
+    __asm volatile ("msr primask, %0" : : "r" (primask));
+}
+
+#define TIMER_RAWL          0x40054028
+
+/**
+ * @brief Carry out the plan for a chunk (see chunk_plan)
+ * 
+ * Only the sectors in the mask have been copied over (the rest are the same as
+ * the flash already), the keep ones are caught up in a bigger erase so we fill
+ * them in from the flash first. Compressed sectors are unpacked (in place) first.
+ * 
+ * Pages that are all 0xff are left alone since they are already erased.
+ * 
+ * If a changed sector only clears bits ((old & new) == new for all of it) then
+ * we can program it over the top without an erase, so if that's true for all
+ * the changed sectors an erase covers we don't do it (and only program the
+ * pages that are different.)
+ */
+FOR_TARGET int flash_block(uint32_t offset, uint8_t *src, int length, struct chunk_info *info) {
     // Fill in the rom functions...
     rom_table_lookup_fn rom_table_lookup = (rom_table_lookup_fn)rom_hword_as_ptr(0x18);
     uint16_t            *function_table = (uint16_t *)rom_hword_as_ptr(0x14);
@@ -190,17 +1792,30 @@ FOR_TARGET int flash_block(uint32_t offset, uint8_t *src, int length) {
     rom_void_fn         _flash_flush_cache = rom_table_lookup(function_table, fn('F', 'C'));
     rom_void_fn         _flash_enter_cmd_xip = rom_table_lookup(function_table, fn('C', 'X'));
 
-    // We want to make sure the flash is connected so that we can compare
-    // with it's current contents...
+    volatile uint32_t   *timer = (volatile uint32_t *)TIMER_RAWL;
+    uint32_t            mask = info->mask;
+    uint32_t            keep = info->keep;
+    uint32_t            noerase = 0;
+    uint16_t            pages[16];          // which pages to program (noerase sectors)
+    uint32_t            stream;
+    uint32_t            t;
+
+    for (int i=0; i < 16; i++) {
+        if (!info->clen[i]) continue;
+
+        int size = MIN(4096, length - (i * 4096));
+        lz_decompress(src + (i * 4096) + (size - info->clen[i]), info->clen[i], src + (i * 4096));
+    }
 
     _connect_internal_flash();
 //    _flash_flush_cache();
 //    _flash_enter_cmd_xip();     // would be better to call the boot stage2 to speed things up
     _flash_exit_xip();
 
-    // If we are being called with a zero offset, then the block will include the bootloader
-    // so we can just copy it to use later...
-    if (offset == 0) {
+    // If we are being called with a zero offset, and the first sector is there, then it
+    // has the bootloader in it so we can copy it to use later (otherwise flash_hash will
+    // have taken it from the flash)...
+    if (offset == 0 && (mask & 1)) {
         uint32_t *s = (uint32_t *)src;
         uint32_t *d = (uint32_t *)BOOT2_START;
         for (int i=0; i < 64; i++) {
@@ -209,88 +1824,406 @@ FOR_TARGET int flash_block(uint32_t offset, uint8_t *src, int length) {
     }
     // Call the second stage bootloader... reconnect XIP
     ((void (*)(void))BOOT2_START+1)();
+    stream = xip_stream_mode();
 
-    // Now lets get started...
-    uint8_t     *changed[3];
-    int         change_count = 0;
-
-    // Go through in 4k chunks seeing if we have deltas...
-    uint8_t     *src_block = src;
-    uint8_t     *dst_block = (uint8_t *)(FLASH_BASE + offset);
-    int         left = length;
-
-
-    while(left > 0) {
-        // Look at this block...
-        uint8_t *s = src_block;
-        uint8_t *d = dst_block;
-        int size = MIN(4096, left);
-        for (int i=0; i < size; i++) {
-            if (*s++ != *d++) {
-                changed[change_count++] = src_block;
-                break;
-            }
+    // See which of the changed sectors can be programmed without an erase...
+    info->noerase = 0;
+    for (int i=0; i < 16; i++) {
+        if (!(mask & (1 << i))) continue;
+
+        uint32_t *old = (uint32_t *)(FLASH_BASE + offset + (i * 4096));
+        uint32_t *new = (uint32_t *)(src + (i * 4096));
+        int words = (MIN(4096, length - (i * 4096)) + 3) / 4;
+        int ok = 1;
+        int blank = 1;
+
+        // Comparing against RAM is quicker than going through the cache a word at a time
+        if (stream != STREAM_NONE) {
+            xip_stream_crc32((uint32_t)old, 4096, (uint32_t *)SCRATCH_BUFFER, stream);
+            old = (uint32_t *)SCRATCH_BUFFER;
+        }
+        pages[i] = 0;
+        for (int w=0; w < words; w++) {
+            if ((old[w] & new[w]) != new[w]) { ok = 0; break; }
+            if (old[w] != new[w]) pages[i] |= (1 << (w / 64));
+            if (old[w] != 0xffffffff) blank = 0;
+        }
+        if (ok) noerase |= (1 << i);
+        if (ok && !blank) info->noerase |= (1 << i);      // the probe counts blank ones itself
+    }
+
+    // Drop any erase where none of the changed sectors need it, otherwise they all
+    // get erased and programmed normally...
+    for (int i=0; i < 16; i++) {
+        int n = info->erase[i];
+        uint32_t range = ((1 << n) - 1) << i;
+
+        if (!n) continue;
+        if (!(mask & range & ~noerase)) {
+            info->erase[i] = 0;
+            keep &= ~range;
+        } else {
+            noerase &= ~range;
+        }
+    }
+    info->noerase &= noerase;
+
+    // Take a copy of anything we need to put back...
+    for (int i=0; i < 16; i++) {
+        if (!(keep & (1 << i))) continue;
+
+        uint32_t *s = (uint32_t *)(FLASH_BASE + offset + (i * 4096));
+        uint32_t *d = (uint32_t *)(src + (i * 4096));
+        if (stream != STREAM_NONE) {
+            xip_stream_crc32((uint32_t)s, 4096, d, stream);
+            continue;
+        }
+        for (int w=0; w < 1024; w++) {
+            *d++ = *s++;
         }
-        if (change_count > 2) break;
-        src_block += 4096;
-        dst_block += 4096;
-        left -= 4096;
     }
-    if (!change_count) return 0;        // nothing to do
 
     // turn off xip so we can do stuff...
-    //_connect_internal_flash();      // do we need this?
     _flash_exit_xip();
+    if (info->baudr) {
+        *(volatile uint32_t *)SSI_SSIENR = 0;
+        *(volatile uint32_t *)SSI_BAUDR = info->baudr;
+        *(volatile uint32_t *)SSI_SSIENR = 1;
+    }
 
     // We will return the number of 4k blocks erased, and the size flashed in this...
     uint32_t rc = 0;
 
-    if (change_count <= 2) {
-
-        // Program the individual blocks...
-        for (int i = 0; i < change_count; i++) {
-            uint8_t *block = changed[i];
-            uint32_t faddr = offset + (block - src);
-            uint32_t size = MIN(4096, length-offset);
-    
-            // erase 4k
-            // program 4k
-            _flash_range_erase(faddr, 4096, 4096, 0x20);      // sector erase (4K)
-            flash_range_program(faddr, block, size);
-            rc += size;
-        }
-        // reconnect xip
-        _flash_flush_cache();
-//        _flash_enter_cmd_xip();
-        // Call the second stage bootloader... reconnect XIP
-        ((void (*)(void))BOOT2_START+1)();
-        return (change_count << 24) | rc;
+    for (int i=0; i < 16; i++) {
+        int n = info->erase[i];
+        int op = (n == 16) ? OP_64K : (n == 8) ? OP_32K : OP_4K;
+
+        if (!n) continue;
+        t = *timer;
+        _flash_range_erase(offset + (i * 4096), n * 4096, n * 4096, (n == 16) ? 0xD8 : (n == 8) ? 0x52 : 0x20);
+        info->op_us[op] += *timer - t;
+        info->op_count[op]++;
+        rc += (n << 24);
     }
-    
-    // Otherwise we program the whole thing... either 32K (if less than that) or all 64k
-    if (length <= 32768) {
-        _flash_range_erase(offset, 32768, 32768, 0x52); // 32K erase
-        rc = 0x08000000 | length;
-    } else {
-        _flash_range_erase(offset, 65536, 65536, 0xD8); // 64K erase
-        rc = 0x10000000 | length;
+
+    // Now program everything that isn't blank, a run of pages at a time...
+    t = *timer;
+    for (int i=0; i < 16; i++) {
+        if (!((mask | keep) & (1 << i))) continue;
+
+        uint8_t *sector = src + (i * 4096);
+        int size = (mask & (1 << i)) ? MIN(4096, length - (i * 4096)) : 4096;
+        int start = -1;
+
+        for (int p=0; p < size; p += 256) {
+            uint32_t *w = (uint32_t *)(sector + p);
+            int words = (MIN(256, size - p) + 3) / 4;
+            int blank = 1;
+
+            if (noerase & (1 << i)) {
+                blank = !(pages[i] & (1 << (p / 256)));
+            } else {
+                for (int j=0; j < words; j++) {
+                    if (w[j] != 0xffffffff) { blank = 0; break; }
+                }
+            }
+            if (!blank) {
+                if (start < 0) start = p;
+                info->op_count[OP_PAGE]++;
+            }
+            if (start >= 0 && (blank || p + 256 >= size)) {
+                int end = blank ? p : size;
+                if (info->qpp) {
+                    qspi_program(offset + (i * 4096) + start, sector + start, end - start, info->qpp);
+                } else {
+                    flash_range_program(offset + (i * 4096) + start, sector + start, end - start);
+                }
+                rc += end - start;
+                start = -1;
+            }
+        }
+    }
+    info->op_us[OP_PAGE] += *timer - t;
+
+    // Erase ahead for the next chunk (see chunk_pre_plan)...
+    for (int i=0; i < 16; i++) {
+        int n = info->pre_erase[i];
+        int op = (n == 16) ? OP_64K : (n == 8) ? OP_32K : OP_4K;
+
+        if (!n) continue;
+        t = *timer;
+        _flash_range_erase(info->pre_offset + (i * 4096), n * 4096, n * 4096, (n == 16) ? 0xD8 : (n == 8) ? 0x52 : 0x20);
+        info->op_us[op] += *timer - t;
+        info->op_count[op]++;
+        rc += (n << 24);
     }
-    // program everything...
-    flash_range_program(offset, src, length);
+
     // reconnect xip
     _flash_flush_cache();
 //    _flash_enter_cmd_xip();
     // Call the second stage bootloader... reconnect XIP
     ((void (*)(void))BOOT2_START+1)();
 
+    // Read back anything the probe wants checking...
+    for (int i=0; i < 16; i++) {
+        if (!(info->verify_mask & (1 << i))) continue;
+
+        uint32_t addr = FLASH_BASE + offset + (i * 4096);
+        info->verify[i] = (stream != STREAM_NONE) ? xip_stream_crc32(addr, 4096, 0, stream)
+                                                  : dma_crc32((uint8_t *)addr, 4096);
+    }
     return rc;
 }
 
+#define RESETS_CLR          (0x4000c000 + 0x3000)       // atomic clear alias of RESETS_RESET
+
+/**
+ * @brief CRC32 each of the 4K sectors of the flash at offset, so the probe can
+ *        work out which ones it needs to send.
+ * 
+ * This is the first thing to run, so we also take a copy of boot2 from the flash
+ * (if it's valid) so that reading the flash, and later flash_block, can use it.
+ */
+FOR_TARGET void flash_hash(uint32_t offset, uint32_t *out, int count) {
+    rom_table_lookup_fn rom_table_lookup = (rom_table_lookup_fn)rom_hword_as_ptr(0x18);
+    uint16_t            *function_table = (uint16_t *)rom_hword_as_ptr(0x14);
+
+    rom_void_fn         _connect_internal_flash = rom_table_lookup(function_table, fn('I', 'F'));
+    rom_void_fn         _flash_exit_xip = rom_table_lookup(function_table, fn('E', 'X'));
+    rom_void_fn         _flash_flush_cache = rom_table_lookup(function_table, fn('F', 'C'));
+    rom_void_fn         _flash_enter_cmd_xip = rom_table_lookup(function_table, fn('C', 'X'));
+
+    uint32_t            *boot2 = (uint32_t *)BOOT2_START;
+    uint32_t            *s = (uint32_t *)FLASH_BASE;
+
+    // We are flashing, so the DMA is ours to use
+    *(volatile uint32_t *)RESETS_CLR = RESETS_DMA;
+    while (!(*(volatile uint32_t *)RESETS_DONE & RESETS_DMA));
+
+    _connect_internal_flash();
+    _flash_exit_xip();
+    _flash_flush_cache();
+    _flash_enter_cmd_xip();
+
+    // boot2 has a CRC32 in the last word, the bootrom won't run it unless it's right
+    for (int i=0; i < 64; i++) boot2[i] = s[i];
+    if (dma_crc32((uint8_t *)boot2, 252) == boot2[63]) {
+        _flash_exit_xip();
+        ((void (*)(void))BOOT2_START+1)();
+    }
+
+    uint32_t stream = xip_stream_mode();
+    for (int i=0; i < count; i++) {
+        uint32_t addr = FLASH_BASE + offset + (i * 4096);
+        out[i] = (stream != STREAM_NONE) ? xip_stream_crc32(addr, 4096, 0, stream) : dma_crc32((uint8_t *)addr, 4096);
+    }
+}
+
+/**
+ * @brief Erase (src is NULL) or program a range of flash, nothing clever
+ */
+FOR_TARGET int flash_raw(uint32_t offset, uint8_t *src, int length) {
+    rom_table_lookup_fn rom_table_lookup = (rom_table_lookup_fn)rom_hword_as_ptr(0x18);
+    uint16_t            *function_table = (uint16_t *)rom_hword_as_ptr(0x14);
+
+    rom_void_fn         _connect_internal_flash = rom_table_lookup(function_table, fn('I', 'F'));
+    rom_void_fn         _flash_exit_xip = rom_table_lookup(function_table, fn('E', 'X'));
+    rom_flash_erase_fn  _flash_range_erase = rom_table_lookup(function_table, fn('R', 'E'));
+    rom_flash_prog_fn   flash_range_program = rom_table_lookup(function_table, fn('R', 'P'));
+    rom_void_fn         _flash_flush_cache = rom_table_lookup(function_table, fn('F', 'C'));
+    rom_void_fn         _flash_enter_cmd_xip = rom_table_lookup(function_table, fn('C', 'X'));
+
+    _connect_internal_flash();
+    _flash_exit_xip();
+    if (src) {
+        flash_range_program(offset, src, length);
+    } else {
+        _flash_range_erase(offset, length, 65536, 0xD8);     // uses 64K erase where it can
+    }
+    _flash_flush_cache();
+    // We might not have a copy of boot2, so use the slower generic XIP setup
+    _flash_enter_cmd_xip();
+    return 0;
+}
+
+#define REG(addr)           (*(volatile uint32_t *)(addr))
+#define RESETS_RESET        0x4000c000
+#define RESETS_SET          (0x4000c000 + 0x2000)       // atomic set alias of RESETS_RESET
+#define RESETS_PLL_SYS      (1 << 12)
+#define CLOCKS_BASE         0x40008000
+#define CLK_REF_CTRL        (CLOCKS_BASE + 0x30)
+#define CLK_REF_SELECTED    (CLOCKS_BASE + 0x38)
+#define CLK_SYS_CTRL        (CLOCKS_BASE + 0x3c)
+#define CLK_SYS_DIV         (CLOCKS_BASE + 0x40)
+#define CLK_SYS_SELECTED    (CLOCKS_BASE + 0x44)
+#define CLK_REF_SRC_XOSC    2
+#define CLK_SYS_SRC_AUX     1                           // aux is pll_sys (AUXSRC 0)
+#define FC0_REF_KHZ         (CLOCKS_BASE + 0x80)
+#define FC0_MIN_KHZ         (CLOCKS_BASE + 0x84)
+#define FC0_MAX_KHZ         (CLOCKS_BASE + 0x88)
+#define FC0_INTERVAL        (CLOCKS_BASE + 0x90)
+#define FC0_SRC             (CLOCKS_BASE + 0x94)
+#define FC0_STATUS          (CLOCKS_BASE + 0x98)
+#define FC0_RESULT          (CLOCKS_BASE + 0x9c)
+#define FC0_SRC_CLK_SYS     0x09
+#define FC0_DONE            (1 << 4)
+#define FC0_RUNNING         (1 << 8)
+#define XOSC_CTRL           0x40024000
+#define XOSC_STATUS         0x40024004
+#define XOSC_STARTUP        0x4002400c
+#define XOSC_RANGE_1_15MHZ  0xaa0
+#define XOSC_ENABLE         (0xfab << 12)
+#define XOSC_DISABLE        (0xd1e << 12)
+#define XOSC_STABLE         (1u << 31)
+#define XOSC_KHZ            12000
+#define PLL_SYS_CS          0x40028000
+#define PLL_SYS_PWR         0x40028004
+#define PLL_SYS_FBDIV       0x40028008
+#define PLL_SYS_PRIM        0x4002800c
+#define PLL_LOCK            (1u << 31)
+#define PLL_PWR_PD          (1 << 0)
+#define PLL_PWR_POSTDIVPD   (1 << 3)
+#define PLL_PWR_VCOPD       (1 << 5)
+#define PLL_PWR_ALL         0x2d
+#define CLOCK_TIMEOUT       1000000
+
+/**
+ * @brief Measure clk_sys with the frequency counter (clk_ref needs to be the xosc)
+ */
+static inline __attribute__((always_inline)) uint32_t clk_sys_khz() {
+    while (REG(FC0_STATUS) & FC0_RUNNING);
+    REG(FC0_REF_KHZ) = XOSC_KHZ;
+    REG(FC0_INTERVAL) = 10;
+    REG(FC0_MIN_KHZ) = 0;
+    REG(FC0_MAX_KHZ) = 0xffffffff;
+    REG(FC0_SRC) = FC0_SRC_CLK_SYS;
+    while (!(REG(FC0_STATUS) & FC0_DONE));
+    return REG(FC0_RESULT) >> 5;
+}
+
+/**
+ * @brief Run clk_sys from pll_sys at 125MHz (12MHz xosc, the same as the SDK)
+ * 
+ * We only do this if clk_sys isn't already on the PLL and pll_sys isn't being
+ * used for anything else (i.e. we are still on the reset clocks.) If the xosc
+ * doesn't start (no crystal?) then we leave everything alone.
+ */
+FOR_TARGET void clock_boost(struct clock_save *save) {
+    int n;
+
+    save->boosted = 0;
+    save->xosc_stable = REG(XOSC_STATUS) & XOSC_STABLE;
+    save->ref_ctrl = REG(CLK_REF_CTRL);
+    save->sys_ctrl = REG(CLK_SYS_CTRL);
+    save->sys_div = REG(CLK_SYS_DIV);
+    save->pll_reset = REG(RESETS_RESET) & RESETS_PLL_SYS;
+    save->pll_pwr = REG(PLL_SYS_PWR);
+    save->before_khz = save->after_khz = 0;
+
+    if ((save->sys_ctrl & 1) || !(save->pll_reset || (save->pll_pwr & PLL_PWR_PD))) {
+        if ((save->ref_ctrl & 3) == CLK_REF_SRC_XOSC) save->before_khz = save->after_khz = clk_sys_khz();
+        return;
+    }
+
+    if (!save->xosc_stable) {
+        REG(XOSC_CTRL) = XOSC_RANGE_1_15MHZ;
+        REG(XOSC_STARTUP) = 47;                         // about 1ms
+        REG(XOSC_CTRL) = XOSC_RANGE_1_15MHZ | XOSC_ENABLE;
+        for (n=0; n < CLOCK_TIMEOUT && !(REG(XOSC_STATUS) & XOSC_STABLE); n++);
+        if (n == CLOCK_TIMEOUT) {
+            REG(XOSC_CTRL) = XOSC_RANGE_1_15MHZ | XOSC_DISABLE;
+            return;
+        }
+    }
+
+    // clk_ref from the xosc, so we know what we are measuring against...
+    REG(CLK_REF_CTRL) = (save->ref_ctrl & ~3) | CLK_REF_SRC_XOSC;
+    while (!(REG(CLK_REF_SELECTED) & (1 << CLK_REF_SRC_XOSC)));
+    save->before_khz = clk_sys_khz();
+
+    // VCO at 1500MHz, divided by 6 and 2...
+    REG(RESETS_CLR) = RESETS_PLL_SYS;
+    while (!(REG(RESETS_DONE) & RESETS_PLL_SYS));
+    REG(PLL_SYS_PWR) = PLL_PWR_ALL;
+    REG(PLL_SYS_CS) = 1;
+    REG(PLL_SYS_FBDIV) = 125;
+    REG(PLL_SYS_PWR) = PLL_PWR_ALL & ~(PLL_PWR_PD | PLL_PWR_VCOPD);
+    for (n=0; n < CLOCK_TIMEOUT && !(REG(PLL_SYS_CS) & PLL_LOCK); n++);
+    if (n == CLOCK_TIMEOUT) {
+        // No lock, so put back everything we've changed (clock_restore won't)
+        REG(PLL_SYS_PWR) = save->pll_pwr;
+        if (save->pll_reset) REG(RESETS_SET) = RESETS_PLL_SYS;
+        REG(CLK_REF_CTRL) = save->ref_ctrl;
+        while (!(REG(CLK_REF_SELECTED) & (1 << (save->ref_ctrl & 3))));
+        if (!save->xosc_stable) REG(XOSC_CTRL) = XOSC_RANGE_1_15MHZ | XOSC_DISABLE;
+        save->after_khz = save->before_khz;
+        return;
+    }
+    REG(PLL_SYS_PRIM) = (6 << 16) | (2 << 12);
+    REG(PLL_SYS_PWR) = PLL_PWR_ALL & ~(PLL_PWR_PD | PLL_PWR_VCOPD | PLL_PWR_POSTDIVPD);
+
+    // clk_sys is on clk_ref (we checked) so we can change the aux source and divider
+    REG(CLK_SYS_DIV) = 1 << 8;
+    REG(CLK_SYS_CTRL) = save->sys_ctrl & ~(7 << 5);
+    REG(CLK_SYS_CTRL) = (save->sys_ctrl & ~(7 << 5)) | CLK_SYS_SRC_AUX;
+    while (!(REG(CLK_SYS_SELECTED) & (1 << CLK_SYS_SRC_AUX)));
+
+    save->after_khz = clk_sys_khz();
+    save->boosted = 1;
+}
+
+/**
+ * @brief Put the clocks back the way clock_boost found them
+ */
+FOR_TARGET void clock_restore(struct clock_save *save) {
+    if (!save->boosted) return;
+
+    REG(CLK_SYS_CTRL) &= ~CLK_SYS_SRC_AUX;
+    while (!(REG(CLK_SYS_SELECTED) & 1));
+    REG(CLK_SYS_CTRL) = save->sys_ctrl;
+    REG(CLK_SYS_DIV) = save->sys_div;
 
+    REG(PLL_SYS_PWR) = save->pll_pwr;
+    if (save->pll_reset) REG(RESETS_SET) = RESETS_PLL_SYS;
 
+    REG(CLK_REF_CTRL) = save->ref_ctrl;
+    while (!(REG(CLK_REF_SELECTED) & (1 << (save->ref_ctrl & 3))));
+    if (!save->xosc_stable) REG(XOSC_CTRL) = XOSC_RANGE_1_15MHZ | XOSC_DISABLE;
+    save->boosted = 0;
+}
 
+// -----------------------------------------------------------------------------------
+// Helper routines for the target, these have their own section so that they can be
+// copied over on their own (see helper_call)
+// -----------------------------------------------------------------------------------
 
+FOR_TARGET_HELPER uint32_t crc_block(uint8_t *addr, uint32_t len) {
+    return dma_crc32(addr, len);
+}
 
+/**
+ * @brief Send a raw command to the flash, the response replaces what was sent
+ * 
+ * XIP is put back afterwards, using boot2 if we have a copy, otherwise the
+ * slower generic setup.
+ */
+FOR_TARGET_HELPER void flash_cmd(uint8_t *buf, int len, uint8_t *boot2) {
+    rom_table_lookup_fn rom_table_lookup = (rom_table_lookup_fn)rom_hword_as_ptr(0x18);
+    uint16_t            *function_table = (uint16_t *)rom_hword_as_ptr(0x14);
 
+    rom_void_fn         _connect_internal_flash = rom_table_lookup(function_table, fn('I', 'F'));
+    rom_void_fn         _flash_exit_xip = rom_table_lookup(function_table, fn('E', 'X'));
+    rom_void_fn         _flash_flush_cache = rom_table_lookup(function_table, fn('F', 'C'));
+    rom_void_fn         _flash_enter_cmd_xip = rom_table_lookup(function_table, fn('C', 'X'));
 
+    _connect_internal_flash();
+    _flash_exit_xip();
+    ssi_xfer(buf, len);
 
+    _flash_flush_cache();
+    if (boot2) {
+        ((void (*)(void))(boot2 + 1))();
+    } else {
+        _flash_enter_cmd_xip();
+    }
+}
@@ -6,4 +6,22 @@
 
 int rp2040_add_flash_bit(uint32_t offset, uint8_t *src, int size);
 
+void flash_queue_init();
+int flash_queue_write(uint32_t offset, uint8_t *src, int size);
+int flash_queue_erase(uint32_t offset, int length);
+void flash_queue_wait();
+int flash_queue_done();
+
+int flash_stream_begin(uint32_t offset);
+int flash_stream_data(uint8_t *src, int len);
+int flash_stream_end(int commit);
+uint8_t *flash_scratch(uint32_t *size);
+
+int rp2040_crc32(uint32_t addr, uint32_t len, uint32_t *crc);
+int rp2040_flash_info(uint32_t *size, uint32_t *blocksize);
+
+uint32_t rp2040_flash_buffer();
+int rp2040_flash_erase(uint32_t offset, int length);
+int rp2040_flash_program(uint32_t offset, int length);
+
 #endif
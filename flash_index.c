@@ -0,0 +1,122 @@
+/**
+ * @file flash_index.c
+ * @author Lee Essen (lee.essen@nowonline.co.uk)
+ * @brief
+ * @version 0.1
+ * @date 2022-08-20
+ *
+ * @copyright Copyright (c) 2022
+ *
+ * A copy of the sector hashes (the same CRC32 that flash_hash uses) for the
+ * flash we last wrote, kept in our own flash so that it survives a restart.
+ *
+ * It's keyed by the unique ID of the target flash, and the flashing code
+ * spot checks a few sectors before trusting it, so it's just a way of not
+ * having to hash the target flash again for the same board.
+ *
+ * There's only the one, for the last board we flashed.
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "lerp/flash.h"
+#include "lerp/debug.h"
+#include "flash_index.h"
+#include "swd.h"
+
+#define FINDEX_FILE         "flash.idx"
+#define FINDEX_MAGIC        0x58444946      // "FIDX"
+
+struct findex_file {
+    uint32_t    magic;
+    uint8_t     uid[FINDEX_UID_LEN];
+    uint32_t    count;                      // how many sectors follow
+    uint32_t    hash[FINDEX_SECTORS];
+    uint8_t     spare[256];                 // write_file rounds up to a page
+};
+#define FINDEX_HDR_LEN      offsetof(struct findex_file, hash)
+
+static struct findex_file   findex;
+static int                  findex_valid = 0;
+static int                  findex_dirty = 0;
+
+/**
+ * @brief Load the saved index if it's for this flash (we might already have it)
+ *
+ * @param uid
+ * @return int      SWD_OK if we have one
+ */
+int findex_load(uint8_t *uid) {
+    int     len;
+
+    if (findex_valid && memcmp(findex.uid, uid, FINDEX_UID_LEN) == 0) return SWD_OK;
+    findex_valid = 0;
+
+    uint8_t *f = file_addr(FINDEX_FILE, &len);
+    if (!f || len < FINDEX_HDR_LEN) return SWD_ERROR;
+
+    memcpy(&findex, f, FINDEX_HDR_LEN);
+    if (findex.magic != FINDEX_MAGIC || memcmp(findex.uid, uid, FINDEX_UID_LEN) != 0) return SWD_ERROR;
+    if (findex.count > FINDEX_SECTORS || len != FINDEX_HDR_LEN + (findex.count * sizeof(uint32_t))) return SWD_ERROR;
+
+    memcpy(findex.hash, f + FINDEX_HDR_LEN, findex.count * sizeof(uint32_t));
+    findex_valid = 1;
+    findex_dirty = 0;
+    debug_printf("FINDEX: loaded %d sectors\r\n", findex.count);
+    return SWD_OK;
+}
+
+/**
+ * @brief Start a new (empty) index for this flash
+ */
+void findex_reset(uint8_t *uid) {
+    memset(&findex, 0, sizeof(findex));
+    findex.magic = FINDEX_MAGIC;
+    memcpy(findex.uid, uid, FINDEX_UID_LEN);
+    findex_valid = 1;
+    findex_dirty = 1;
+}
+
+uint32_t findex_get(uint32_t sector) {
+    if (!findex_valid || sector >= findex.count) return FINDEX_UNKNOWN;
+    return findex.hash[sector];
+}
+
+void findex_set(uint32_t sector, uint32_t hash) {
+    if (!findex_valid || sector >= FINDEX_SECTORS) return;
+    if (sector >= findex.count) {
+        if (hash == FINDEX_UNKNOWN) return;
+        findex.count = sector + 1;
+    }
+    if (findex.hash[sector] != hash) {
+        findex.hash[sector] = hash;
+        findex_dirty = 1;
+    }
+}
+
+/**
+ * @brief Write it out (only if it's changed)
+ */
+int findex_save() {
+    if (!findex_valid || !findex_dirty) return SWD_OK;
+    write_file(FINDEX_FILE, (uint8_t *)&findex, FINDEX_HDR_LEN + (findex.count * sizeof(uint32_t)));
+    findex_dirty = 0;
+    debug_printf("FINDEX: saved %d sectors\r\n", findex.count);
+    return SWD_OK;
+}
+
+/**
+ * @brief We don't know what's in the flash any more, so drop the index (and
+ *        the saved one)
+ */
+void findex_forget() {
+    uint32_t    *f = file_addr(FINDEX_FILE, NULL);
+
+    findex_valid = 0;
+    if (f && *f == FINDEX_MAGIC) {
+        memset(&findex, 0, sizeof(findex));
+        write_file(FINDEX_FILE, (uint8_t *)&findex, FINDEX_HDR_LEN);
+    }
+}
@@ -0,0 +1,18 @@
+
+#ifndef __FLASH_INDEX_H
+#define __FLASH_INDEX_H
+
+#include <stdint.h>
+
+#define FINDEX_UID_LEN      8
+#define FINDEX_SECTORS      1024            // 4MB worth of 4K sectors
+#define FINDEX_UNKNOWN      0
+
+int findex_load(uint8_t *uid);
+void findex_reset(uint8_t *uid);
+uint32_t findex_get(uint32_t sector);
+void findex_set(uint32_t sector, uint32_t hash);
+int findex_save();
+void findex_forget();
+
+#endif
@@ -13,6 +13,11 @@
 #include "utils.h"
 #include "flash.h"
 #include "breakpoint.h"
+#include "trace.h"
+#include "rtos.h"
+#include "monitor.h"
+#include "stats.h"
+#include "config/config.h"
 
 #include "lerp/debug.h"
 #include "lerp/io.h"
@@ -23,11 +28,20 @@
 
 #define GDB_BUFFER_SIZE 16384
 
-static char gdb_buffer[GDB_BUFFER_SIZE + 1];
+// What we tell GDB, this is bigger than our buffer since the big packets (writes) are
+// streamed as they arrive (flash packets are held on the probe until they are complete,
+// see SECTOR_SLOTS in flash.c)
+#define GDB_PACKET_SIZE 65536
+
+// Two packet buffers, so a vFlashWrite payload can be handed off in place to the
+// flash write-behind queue while we receive the next packet into the other one.
+static char gdb_buffers[2][GDB_BUFFER_SIZE + 1];
+static char *gdb_buffer = gdb_buffers[0];
 static char *gdb_bp;
 static int gdb_blen;
 static int gdb_noack = 0;
 static int gdb_intr = 0;        // have we received an interrupt?
+static int gdb_nonstop = 0;     // are we in non-stop mode?
 
 struct io *gdb_io = NULL;       // the IO structure for GDB
 
@@ -68,6 +82,7 @@ enum {
     BP_NACK,
     BP_INTR,
     BP_PACKET,
+    BP_STREAMED,    // packet was processed as it arrived
     BP_CORRUPT,
     BP_GARBAGE,
     BP_CHKSUM_FAIL,
@@ -77,6 +92,130 @@ enum {
 };
 
 
+// --------------------------------------------------------------------------
+// Cut-through processing for large writes (vFlashWrite, X and M)
+//
+// Once we have seen the header we send the payload on to the target in blocks
+// while the rest of the packet is still arriving, rather than waiting for all
+// of it. The checksum is only known at the end, so flash data is staged on the
+// probe and only accounted for (and programmed) once the packet is good, a
+// bad one is just forgotten.
+//
+// Memory writes go straight to the target. In no-ack mode GDB won't resend a bad
+// packet, so we can't leave it to be overwritten, instead we read what was there
+// first (into the flash sector slots, which are idle outside of a flash write) and
+// put it back. With acks on the resend puts it right, so we don't bother.
+// --------------------------------------------------------------------------
+
+#define STREAM_BLOCK        1024        // how much we gather before writing
+#define STREAM_MIN          256         // smaller X/M packets are processed normally
+
+static int          st_type = 0;        // 0 (not streaming), 'v', 'X' or 'M'
+static char         *st_payload;        // where the payload starts in gdb_buffer
+static uint32_t     st_start;           // X/M: target address of the first block
+static uint32_t     st_addr;            // X/M: target address for the next block
+static uint32_t     st_left;            // X/M: how many bytes are still expected
+static uint8_t      *st_undo;           // X/M: what was there before (NULL if we aren't keeping it)
+static int          st_error;
+static int          st_bytes;           // payload received so far (for the stats)
+
+/**
+ * @brief Called on each colon before we are streaming to see if we have the
+ *        full header of something we can stream
+ */
+static void stream_check_header() {
+    uint32_t addr, len;
+    char *p;
+
+    *gdb_bp = 0;
+    if (strncmp(gdb_buffer, "vFlashWrite:", 12) == 0) {
+        addr = strtoul(gdb_buffer + 12, &p, 16);
+        if (p != gdb_bp - 1 || p == gdb_buffer + 12) return;
+        st_error = (flash_stream_begin(addr & 0x00ffffff) != 0);
+    } else if (*gdb_buffer == 'X' || *gdb_buffer == 'M') {
+        p = get_two_hex_numbers(gdb_buffer + 1, ',', &addr, &len);
+        if (p != gdb_bp - 1 || len < STREAM_MIN) return;
+        flash_queue_wait();
+        st_start = st_addr = addr;
+        st_left = len;
+        st_undo = NULL;
+        st_error = 0;
+        if (gdb_noack) {
+            uint32_t undo_size;
+
+            st_undo = flash_scratch(&undo_size);
+            st_error = (!st_undo || len > undo_size);
+        }
+    } else {
+        return;
+    }
+    st_type = *gdb_buffer;
+    st_payload = gdb_bp;
+    st_bytes = 0;
+    stats_start();
+}
+
+/**
+ * @brief Send whatever payload we have gathered to the target and reset the
+ *        buffer back to the start of the payload
+ */
+static void stream_drain() {
+    int len = gdb_bp - st_payload;
+
+    st_bytes += len;
+    if (len && !st_error) {
+        switch(st_type) {
+            case 'v':
+                st_error = (flash_stream_data((uint8_t *)st_payload, len) != 0);
+                break;
+            case 'M':
+                // Convert the hex in place (we always drain an even number)...
+                len /= 2;
+                for (int i=0; i < len; i++) st_payload[i] = hex_byte(st_payload + (i * 2));
+                // fall through
+            case 'X':
+                len = MIN(len, st_left);
+                if (st_undo) {
+                    uint8_t *undo = st_undo + (st_addr - st_start);
+                    if (mem_read_block(st_addr, len, undo) != SWD_OK) { st_error = 1; break; }
+                    bp_hide(st_addr, len, undo);
+                }
+                bp_patch_write(st_addr, len, (uint8_t *)st_payload);
+                rtos_invalidate();
+                st_addr += len;
+                st_left -= len;
+                if (mem_write_block(st_addr - len, len, (uint8_t *)st_payload) != SWD_OK) st_error = 1;
+                break;
+        }
+    }
+    gdb_bp = st_payload;
+    gdb_blen = gdb_bp - gdb_buffer;
+}
+
+/**
+ * @brief The end of a streamed packet, commit if the checksum was ok.
+ *
+ * For a memory write that failed (or wasn't good) we put back what was there if we
+ * kept it, including the originals of any breakpoints we wrote over.
+ */
+static void stream_end(int good) {
+    if (!st_type) return;
+    if (st_type == 'v') {
+        if (flash_stream_end(good && !st_error) != 0) st_error = 1;
+        return;
+    }
+    if (st_left) st_error = 1;
+    if ((!good || st_error) && st_undo && st_addr != st_start) {
+        int len = st_addr - st_start;
+
+        debug_printf("STREAM: restoring %d bytes at 0x%08x\r\n", len, st_start);
+        bp_patch_write(st_start, len, st_undo);
+        rtos_invalidate();
+        mem_write_block(st_start, len, st_undo);
+    }
+    mem_flush_cache();
+}
+
 static int build_packet() {
     static int state = BP_INIT;
     static uint8_t checksum;
@@ -106,6 +245,7 @@ static int build_packet() {
                 if (ch == '}') { state = BP_ESC; break; }
                 *gdb_bp++ = ch;
                 gdb_blen++;
+                if (ch == ':' && !st_type) stream_check_header();
                 break;
 
             case BP_ESC:
@@ -116,28 +256,41 @@ static int build_packet() {
                 break;
 
             case BP_CHK1:
+                if (st_type) stream_drain();
                 *gdb_bp++ = 0; // zero terminate for ease later
                 digit = hex_digit(ch);
-                if (digit == -1) { state = BP_INIT; return BP_CORRUPT; }
+                if (digit == -1) { state = BP_INIT; stream_end(0); st_type = 0; return BP_CORRUPT; }
                 supplied_sum = (digit << 4);
                 state = BP_CHK2;
                 break;
 
             case BP_CHK2:
                 digit = hex_digit(ch);
-                if (digit == -1) { state = BP_INIT; return BP_CORRUPT; }
+                if (digit == -1) { state = BP_INIT; stream_end(0); st_type = 0; return BP_CORRUPT; }
                 supplied_sum |= digit;
-                if (supplied_sum != checksum) { state = BP_INIT; return BP_CHKSUM_FAIL; }
+                if (supplied_sum != checksum) {
+                    state = BP_INIT;
+                    if (st_type) { stream_end(0); st_type = 0; }
+                    return BP_CHKSUM_FAIL;
+                }
                 state = BP_INIT;
+                if (st_type) {
+                    stream_end(1);
+                    return BP_STREAMED;
+                }
                 return BP_PACKET;
         }
+        if (st_type && state == BP_DATA && (gdb_bp - st_payload) >= STREAM_BLOCK) stream_drain();
         if (gdb_blen == GDB_BUFFER_SIZE) {
             debug_printf("BUFFER OVERFLOW\r\n");
+            state = BP_INIT;
+            if (st_type) { stream_end(0); st_type = 0; }
             return BP_OVERFLOW;
         }
     }
     if (ch == IO_DISCONNECT) {
         state = BP_INIT;
+        if (st_type) { stream_end(0); st_type = 0; }
         return BP_DISCONNECT;
     }
     return BP_RUNNING;
@@ -147,42 +300,138 @@ static int build_packet() {
 // -----------------------------------------------------------------------------
 // The Various Reply Functions (using io)
 // -----------------------------------------------------------------------------
+//
+// Rather than pushing every character through io_put_byte we write directly into
+// the contiguous free space at the head of the io output circ, and then commit it
+// in one go when we run out (or get to the end of the packet).
+//
+// Hex encoding uses a table with both characters in one word (first char in the
+// low half, second in the high half) so we can also add up the checksum for both
+// halves in one go and fold it at the end of each chunk.
+//
 
-int reply(char *text, uint8_t *hex, int hexlen) {
-    uint8_t sum = 0;
+static uint8_t  *rb_ptr;            // where we are writing to in the circ
+static int      rb_space;           // contiguous space left
+static int      rb_used;            // how much have we written (uncommitted)
+static uint8_t  rb_sum;             // running checksum
 
-    io_put_byte(gdb_io, '$');
+static uint32_t hex_table[256];
+#define HEX_CHUNK           256     // keeps the table sums within 16 bits
 
-    if (text) {
-        char *p = text;
-        while (*p) {
-            sum += *p;
-            io_put_byte(gdb_io, *p++);
-        }
+static void hex_table_init() {
+    static const char hexdigits[] = "0123456789abcdef";
+
+    for (int i=0; i < 256; i++) {
+        hex_table[i] = hexdigits[i >> 4] | (hexdigits[i & 0xf] << 16);
     }
-    if (hex) {
-        uint8_t *p = hex;
-        while (hexlen--) {
-            sum += io_put_hexbyte(gdb_io, *p++);
-        }
+}
+
+static int rb_flush() {
+    io_commit(gdb_io, rb_used);
+    rb_used = 0;
+    rb_ptr = io_reserve(gdb_io, &rb_space);
+    return (rb_ptr ? 0 : -1);
+}
+
+static inline void rb_byte(uint8_t ch) {
+    if (!rb_space && rb_flush() != 0) return;
+    *rb_ptr++ = ch;
+    rb_space--;
+    rb_used++;
+}
+
+static void rb_start(char ch) {
+    if (!hex_table[0]) hex_table_init();
+    rb_used = 0;
+    rb_space = 0;
+    rb_sum = 0;
+    rb_byte(ch);
+}
+
+static void rb_text(char *text, int len) {
+    while (len) {
+        if (!rb_space && rb_flush() != 0) return;
+
+        int n = MIN(len, rb_space);
+        memcpy(rb_ptr, text, n);
+        for (int i=0; i < n; i++) rb_sum += text[i];
+        rb_ptr += n; rb_space -= n; rb_used += n;
+        text += n; len -= n;
     }
-    io_put_byte(gdb_io, '#');
-    io_put_hexbyte(gdb_io, sum);
-    return 0;
 }
-int reply_part(char ch, char *text, int len) {
-    uint8_t sum = ch;
 
-    io_put_byte(gdb_io, '$');
-    io_put_byte(gdb_io, ch);
-    while (len--) {
-        sum += *text;
-        io_put_byte(gdb_io, *text++);
+static void rb_hex(uint8_t *hex, int len) {
+    while (len) {
+        if (rb_space < 2 && rb_flush() != 0) return;
+        if (rb_space < 2) {
+            // Only one byte before the wrap, so do it the slow way...
+            uint32_t v = hex_table[*hex++];
+            rb_sum += (v & 0xff) + (v >> 16);
+            rb_byte(v & 0xff);
+            rb_byte(v >> 16);
+            len--;
+            continue;
+        }
+        int n = MIN(MIN(len, rb_space / 2), HEX_CHUNK);
+        uint32_t acc = 0;
+        uint8_t *p = rb_ptr;
+
+        len -= n;
+        rb_ptr += n * 2; rb_space -= n * 2; rb_used += n * 2;
+
+        while (n >= 4) {
+            uint32_t v0 = hex_table[hex[0]], v1 = hex_table[hex[1]];
+            uint32_t v2 = hex_table[hex[2]], v3 = hex_table[hex[3]];
+
+            p[0] = v0; p[1] = v0 >> 16; p[2] = v1; p[3] = v1 >> 16;
+            p[4] = v2; p[5] = v2 >> 16; p[6] = v3; p[7] = v3 >> 16;
+            acc += v0 + v1 + v2 + v3;
+            hex += 4; p += 8; n -= 4;
+        }
+        while (n--) {
+            uint32_t v = hex_table[*hex++];
+            *p++ = v;
+            *p++ = v >> 16;
+            acc += v;
+        }
+        rb_sum += (acc & 0xffff) + (acc >> 16);
     }
-    io_put_byte(gdb_io, '#');
-    io_put_hexbyte(gdb_io, sum);
+}
+
+static int rb_end() {
+    uint32_t v = hex_table[rb_sum];
+
+    rb_byte('#');
+    rb_byte(v & 0xff);
+    rb_byte(v >> 16);
+    io_commit(gdb_io, rb_used);
+    rb_used = 0;
     return 0;
 }
+
+int reply(char *text, uint8_t *hex, int hexlen) {
+    rb_start('$');
+    if (text) rb_text(text, strlen(text));
+    if (hex) rb_hex(hex, hexlen);
+    return rb_end();
+}
+int reply_part(char ch, char *text, int len) {
+    rb_start('$');
+    rb_text(&ch, 1);
+    rb_text(text, len);
+    return rb_end();
+}
+/**
+ * @brief Send an asynchronous notification (e.g. %Stop), these are not acked
+ * 
+ * @param text 
+ * @return int 
+ */
+int reply_notify(char *text) {
+    rb_start('%');
+    rb_text(text, strlen(text));
+    return rb_end();
+}
 int reply_null() {
     return reply(NULL, NULL, 0);
 }
@@ -195,26 +444,22 @@ int reply_err(uint8_t err) {
     return reply("E", &err, 1);
 }
 
-static void _reply_out(char ch, void *arg) {
-    uint8_t *sp = (uint8_t *)arg;
-
-    *sp += ch;
-    io_put_byte(gdb_io, ch);
+static void _reply_out(char ch, UNUSED void *arg) {
+    rb_sum += ch;
+    rb_byte(ch);
 }
 
 int reply_printf(char *format, ...) {
-    uint8_t sum = 0;
     int len;
 
-    io_put_byte(gdb_io, '$');
+    rb_start('$');
 
     va_list args;
     va_start(args, format);
-    len = vfctprintf(_reply_out, &sum, format, args);
+    len = vfctprintf(_reply_out, NULL, format, args);
     va_end(args);
 
-    io_put_byte(gdb_io, '#');
-    io_put_hexbyte(gdb_io, sum);
+    rb_end();
     return len;
 }
 
@@ -241,6 +486,23 @@ int decode_xfer_read(char *packet, int *offset, int *length) {
 }
 
 
+/**
+ * @brief Registers and memory come from the selected trace frame (if there is
+ *        one) rather than the target, and registers for a (not running) RTOS
+ *        task come from its saved frame.
+ */
+static int view_reg_read(int reg, uint32_t *value) {
+    if (trace_frame_selected()) return trace_frame_reg(reg, value);
+    if (rtos_selected()) return rtos_task_reg(reg, value);
+    return reg_read(reg, value);
+}
+static int view_mem_read(uint32_t addr, uint32_t len, uint8_t *dest) {
+    if (trace_frame_selected()) return trace_frame_mem(addr, len, dest);
+    CHECK_OK(mem_read_block(addr, len, dest));
+    bp_hide(addr, len, dest);
+    return SWD_OK;
+}
+
 void function_get_sys_regs() {
     static char *buf = NULL;
 
@@ -254,7 +516,13 @@ void function_get_sys_regs() {
         uint32_t rval;
         int rc;
 
-        rc = reg_read(i, &rval);
+        rc = view_reg_read(i, &rval);
+        if (rc != SWD_OK && (trace_frame_selected() || rtos_selected())) {
+            // Not collected in this trace frame (or not saved for the task)...
+            strcpy(p, "xxxxxxxx");
+            p += 8;
+            continue;
+        }
         if (rc != SWD_OK) { reply_err(1); return; }
         sprintf(p, "%02x%02x%02x%02x", (uint8_t)(rval & 0xff), (uint8_t)((rval & 0xff00) >> 8), 
                                                 (uint8_t)((rval & 0xff0000) >> 16), (uint8_t)(rval >> 24));
@@ -266,7 +534,7 @@ void function_get_sys_regs() {
 void function_get_reg(char *packet) {
     uint32_t rval;
     int reg = strtoul(packet, NULL, 16);
-    int rc = reg_read(reg, &rval);
+    int rc = view_reg_read(reg, &rval);
     if (rc != SWD_OK) { reply_err(1); return; }
     reply_printf("%02x%02x%02x%02x", (uint8_t)(rval & 0xff), (uint8_t)((rval & 0xff00) >> 8), 
                                             (uint8_t)((rval & 0xff0000) >> 16), (uint8_t)(rval >> 24));
@@ -284,6 +552,11 @@ void function_put_reg(char *packet) {
         return;
     }
     value = hex_word_le32(sep + 1);
+    if (rtos_selected()) {
+        // We don't write back into a task's saved frame
+        reply_err(1);
+        return;
+    }
     rc = reg_write(reg, value);
     if (rc != SWD_OK) {
         reply_err(1);
@@ -294,34 +567,32 @@ void function_put_reg(char *packet) {
 
 
 void function_memread(char *packet) {
-    uint8_t small_buf[10];
+    static uint8_t buf[STREAM_BLOCK];
     uint32_t addr, len;
-    int rc;
+    int count;
 
     if (!get_two_hex_numbers(packet, ',', &addr, &len)) {
         reply_null();
         return;
     }
 
-    // If we are a small request then use the small buffer...
-    if (len <= 4) {
-        rc = mem_read_block(addr, len, small_buf);
-        if (rc != SWD_OK) { reply_err(1); return; }
-        reply(NULL, small_buf, len);
-        return;
-    }
-
-    // Otherwise we'll need to malloc one...
-    char *buffer = malloc(len); // make sure we have enough space
-    if (!buffer) {
-        reply_null();
-        return;
+    // We read (and encode) a block at a time, so we can cope with anything up to
+    // the packet size. If the first read fails it's an error, after that we just
+    // return what we managed to get.
+    count = MIN(len, STREAM_BLOCK);
+    if (view_mem_read(addr, count, buf) != SWD_OK) { reply_err(1); return; }
+
+    rb_start('$');
+    while (1) {
+        rb_hex(buf, count);
+        addr += count;
+        len -= count;
+        if (!len) break;
+
+        count = MIN(len, STREAM_BLOCK);
+        if (view_mem_read(addr, count, buf) != SWD_OK) break;
     }
-    rc = mem_read_block(addr, len, (uint8_t *)buffer);
-    if (rc != SWD_OK) { reply_err(1); return; }
-    reply(NULL, (uint8_t *)buffer, len);
-    free(buffer);
-    return;
+    rb_end();
 }
 
 void function_memwrite(char *packet)
@@ -346,11 +617,62 @@ void function_memwrite(char *packet)
     }
 
     // And now write it...
+    bp_patch_write(addr, length, (uint8_t *)gdb_buffer);
+    rtos_invalidate();
     rc = mem_write_block(addr, length, (uint8_t *)gdb_buffer);
     if (rc != SWD_OK) { reply_err(1); return; }
     reply_ok();
 }
 
+void function_binwrite(char *packet, int packet_size) {
+    uint32_t addr, length;
+    char *p = get_two_hex_numbers(packet, ',', &addr, &length);
+
+    if (!p || *p != ':') {
+        reply_null();
+        return;
+    }
+    p++;
+    if (length > packet_size - (p - packet)) { reply_err(1); return; }
+
+    // A zero length write is GDB checking if we support X
+    bp_patch_write(addr, length, (uint8_t *)p);
+    rtos_invalidate();
+    if (length && mem_write_block(addr, length, (uint8_t *)p) != SWD_OK) { reply_err(1); return; }
+    reply_ok();
+}
+
+enum { CORE_NONE=0, CORE_STEP, CORE_RUN, CORE_RANGE, CORE_STOP };
+
+// How many steps we do in a range before checking for CTRL-C etc.
+#define RANGE_STEP_BATCH        32
+
+/**
+ * @brief If a core stopped on a conditional breakpoint, and the condition is false, or
+ *        on a tracepoint (where we collect the frame), then step it over the breakpoint
+ *        and let it carry on. Returns 1 if we did.
+ *
+ * If GDB has its own breakpoint at a tracepoint then that still decides.
+ * 
+ * @param num 
+ * @return int 
+ */
+static int bp_auto_resume(int num) {
+    int cur = core_get();
+    int resumed = 0;
+    uint32_t pc;
+
+    if (core_get_reason(num) != REASON_BREAKPOINT) return 0;
+
+    core_select(num);
+    if (reg_read(15, &pc) == SWD_OK) {
+        int resume = trace_hit(pc) ? (!trace_shared_bp(pc) || !bp_should_stop(pc)) : !bp_should_stop(pc);
+        if (resume) resumed = (bp_step_over(pc) == SWD_OK);
+    }
+    core_select(cur);
+    return resumed;
+}
+
 int reason_to_stopcode(int reason) {
     switch (reason) {
         case REASON_DBGRQ:          return (0x02);
@@ -374,12 +696,204 @@ int reason_to_stopcode(int reason) {
  * @param thread 
  * @param reason 
  */
-void send_stop_packet(int thread, int reason) {
+static int format_stop_reply(char *buf, int size, int thread, int reason) {
+    static const char *watch_types[] = { "", "", "watch", "rwatch", "awatch" };
+
     if (gdb_intr) {
         reason = REASON_DBGRQ;
         gdb_intr = 0;
     }
-    reply_printf("T%02dthread:%d;", reason_to_stopcode(reason), thread);
+    if (reason == REASON_WATCHPOINT) {
+        uint32_t addr;
+        int type = core_get_watch(thread-1, &addr);
+        if (type) {
+            return snprintf(buf, size, "T%02d%s:%x;thread:%d;", reason_to_stopcode(reason), watch_types[type], (unsigned int)addr, thread);
+        }
+    }
+    return snprintf(buf, size, "T%02dthread:%d;", reason_to_stopcode(reason), thread);
+}
+
+void send_stop_packet(int thread, int reason) {
+    char buf[48];
+
+    format_stop_reply(buf, sizeof(buf), thread, reason);
+    reply(buf, NULL, 0);
+}
+
+// -----------------------------------------------------------------------------------------------
+// Non-stop mode
+//
+// Here vCont just starts the cores and replies OK, we then keep an eye on the running cores
+// in the background (ns_poll) while still processing packets. When a core stops we queue
+// a stop reply and send a %Stop notification, GDB then collects the rest with vStopped.
+//
+// The other core is never stopped on our behalf.
+// -----------------------------------------------------------------------------------------------
+
+static int ns_running[2];               // is the core running (according to us)
+static int ns_ranging[2];               // are we range stepping it
+static uint32_t ns_range_start[2];
+static uint32_t ns_range_end[2];
+static int ns_pending[2];               // queued stop reason for the core (or -1)
+static int ns_sent = -1;                // which core we have an outstanding stop reply for
+
+static void ns_reset() {
+    for (int i=0; i < 2; i++) {
+        ns_running[i] = ns_ranging[i] = 0;
+        ns_pending[i] = -1;
+    }
+    ns_sent = -1;
+}
+
+static int ns_any_running() {
+    return ns_running[0] || ns_running[1];
+}
+
+static int ns_next_pending() {
+    for (int i=0; i < 2; i++) {
+        if (ns_pending[i] != -1) return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Queue a stop for a core and notify GDB (unless we are already in a
+ *        notification sequence, in which case vStopped will pick it up)
+ * 
+ * @param num 
+ * @param reason 
+ */
+static void ns_queue_stop(int num, int reason) {
+    char buf[48];
+
+    ns_running[num] = ns_ranging[num] = 0;
+    ns_pending[num] = reason;
+    if (ns_sent != -1) return;
+
+    strcpy(buf, "Stop:");
+    format_stop_reply(buf + 5, sizeof(buf) - 5, num + 1, reason);
+    reply_notify(buf);
+    ns_sent = num;
+}
+
+/**
+ * @brief Background monitor for running cores (non-stop mode), restores the
+ *        selected core when done.
+ */
+static void ns_poll() {
+    int cur = core_get();
+
+    for (int i=0; i < 2; i++) {
+        if (!ns_running[i]) continue;
+
+        core_select(i);
+        if (ns_ranging[i]) {
+            int done;
+            int rc = core_step_range(ns_range_start[i], ns_range_end[i], RANGE_STEP_BATCH, &done);
+            if (rc != SWD_OK || done) ns_queue_stop(i, core_get_reason(i));
+            continue;
+        }
+        if (core_check_halted() == 1) {
+            if (bp_auto_resume(i)) continue;
+            debug_printf("CORE %d has halted (non-stop)\r\n", i);
+            ns_queue_stop(i, core_get_reason(i));
+        }
+    }
+    core_select(cur);
+}
+
+/**
+ * @brief Start/step/stop the cores as per the vCont actions, leaving the
+ *        others alone.
+ * 
+ * @param action 
+ * @param start 
+ * @param end 
+ */
+static void ns_resume(int action[2], uint32_t start, uint32_t end) {
+    int cur = core_get();
+
+    for (int i=0; i < 2; i++) {
+        if (action[i] == CORE_NONE) continue;
+        core_select(i);
+
+        if (action[i] == CORE_STOP) {
+            if (ns_running[i]) {
+                core_halt();
+                // vCont;t stops are reported with signal 0
+                ns_queue_stop(i, REASON_NOTHALTED);
+            }
+            continue;
+        }
+        if (ns_running[i]) continue;            // can't resume a running core
+
+        switch (action[i]) {
+            case CORE_RUN:      core_unhalt(); break;
+            case CORE_STEP:     core_step(); break;
+            case CORE_RANGE:
+                ns_ranging[i] = 1;
+                ns_range_start[i] = start;
+                ns_range_end[i] = end;
+                break;
+        }
+        ns_running[i] = 1;
+    }
+    core_select(cur);
+}
+
+GDBFUNC(vStopped) {
+    int next;
+
+    // This acks the stop reply we last sent...
+    if (ns_sent != -1) ns_pending[ns_sent] = -1;
+
+    next = ns_next_pending();
+    if (next == -1) {
+        ns_sent = -1;
+        reply_ok();
+        return;
+    }
+    ns_sent = next;
+    send_stop_packet(next + 1, ns_pending[next]);
+}
+
+/**
+ * @brief The '?' packet in non-stop mode reports all of the stopped cores, the
+ *        first here and the rest through vStopped.
+ */
+void ns_report_stopped() {
+    for (int i=0; i < 2; i++) {
+        ns_pending[i] = ns_running[i] ? -1 : core_get_reason(i);
+    }
+    ns_sent = ns_next_pending();
+    if (ns_sent == -1) {
+        reply_ok();
+        return;
+    }
+    send_stop_packet(ns_sent + 1, ns_pending[ns_sent]);
+}
+
+GDBFUNC(QNonStop) {
+    if (*packet == '1') {
+        gdb_nonstop = 1;
+    } else if (*packet == '0') {
+        gdb_nonstop = 0;
+    } else {
+        reply_err(1);
+        return;
+    }
+    ns_reset();
+
+    // If we attached without halting then the cores may well be running
+    if (gdb_nonstop) {
+        int cur = core_get();
+        for (int i=0; i < 2; i++) {
+            core_select(i);
+            ns_running[i] = (core_is_halted() == 0);
+        }
+        core_select(cur);
+    }
+    reply_ok();
 }
 
 
@@ -400,28 +914,95 @@ void send_stop_packet(int thread, int reason) {
 
 
 
+/**
+ * @brief Work through the vCont actions and work out what each core should do
+ *
+ * Actions are of the form ;action[:thread] and the first one that matches
+ * a given thread wins (one with no thread applies to anything not yet set.)
+ *
+ * Range steps (r start,end) are recorded in start/end.
+ *
+ * Returns 0 on failure, 1 on success
+ *
+ * @param packet
+ * @param action
+ * @param start
+ * @param end
+ * @return int
+ */
+static int vcont_parse(char *packet, int action[2], uint32_t *start, uint32_t *end) {
+    char *p = packet;
+
+    action[0] = action[1] = CORE_NONE;
+
+    while (*p == ';') {
+        int act;
+        char *sep;
+
+        switch (*++p) {
+            case 'c':   act = CORE_RUN; p++; break;
+            case 'C':   act = CORE_RUN; p += 3; break;       // we ignore the signal
+            case 's':   act = CORE_STEP; p++; break;
+            case 'S':   act = CORE_STEP; p += 3; break;
+            case 't':   act = CORE_STOP; p++; break;
+            case 'r':
+                act = CORE_RANGE;
+                sep = get_two_hex_numbers(p + 1, ',', start, end);
+                if (!sep) return 0;
+                p = sep;
+                break;
+            default:
+                return 0;
+        }
+        if (*p == ':') {
+            int tid = strtol(p + 1, &sep, 16);
+            p = sep;
+
+            // A task thread isn't running on either core (those are threads 1 and 2)
+            // so the action applies to the core that stopped (the current one)
+            if (tid > 2 && rtos_task_valid(tid)) tid = core_get() + 1;
+            if (tid >= 1 && tid <= 2) {
+                if (action[tid - 1] == CORE_NONE) action[tid - 1] = act;
+                continue;
+            }
+            if (tid != -1 && tid != 0) return 0;
+        }
+        for (int i=0; i < 2; i++) {
+            if (action[i] == CORE_NONE) action[i] = act;
+        }
+    }
+    return (*p == 0);
+}
+
 GDBFUNC(vCont) {
-    enum { CORE_STEP=0, CORE_RUN };
     int cur = core_get();
     int other = 1 - cur;
     int action[2];
+    uint32_t range_start, range_end;
+    int ranging = -1;               // core we are range stepping (if any)
 
     if (*packet == '?') {
-        static const char vcont[] = "vCont;c;C;s;S";
+        static const char vcont[] = "vCont;c;C;s;S;t;r";
         reply((char *)vcont, NULL, 0);
         return;
     }
-    if (strncmp(packet, ";s:1;c", 6) == 0 || strncmp(packet, ";s:1", 4) == 0) {
-        action[0] = CORE_STEP;
-        action[1] = CORE_RUN;
-    } else if (strncmp(packet, ";s:2;c", 6) == 0 || strncmp(packet, ";s:2", 4) == 0) {
-        action[0] = CORE_RUN;
-        action[1] = CORE_STEP;
-    } else if (strncmp(packet, ";c", 2) == 0) {
-        action[0] = CORE_RUN;
-        action[1] = CORE_RUN;
-    } else {
+    if (!vcont_parse(packet, action, &range_start, &range_end)) {
         debug_printf("UNRECOGNISED vCONT: %s\r\n", packet);
+        reply_null();
+        return;
+    }
+    // Get the software breakpoints in line with what GDB wants...
+    if (bp_sync() != SWD_OK) {
+        reply_err(1);
+        return;
+    }
+    // Anything we know about the RTOS tasks is about to be out of date
+    rtos_invalidate();
+    rtos_select(0);
+
+    if (gdb_nonstop) {
+        ns_resume(action, range_start, range_end);
+        reply_ok();
         return;
     }
 
@@ -447,13 +1028,46 @@ GDBFUNC(vCont) {
         debug_printf("stepping core\r\n");
         core_step();
     }
+    // Range stepping is done in the loop below, only one core can do it...
+    if (action[cur] == CORE_RANGE) {
+        ranging = cur;
+    } else if (action[other] == CORE_RANGE) {
+        ranging = other;
+    }
 
     core_select(cur);
 
     // We now loop waiting for a core to stop ... during this we need to check for INTR input
     // or a loss of connection...
     while(1) {
+        if (ranging != -1) {
+            int done;
+            int rc;
+
+            core_select(ranging);
+            rc = core_step_range(range_start, range_end, RANGE_STEP_BATCH, &done);
+            if (rc != SWD_OK || done) {
+                // The stepping core is halted, so we just need to stop the other one...
+                debug_printf("CORE %d has left range 0x%08x-0x%08x\r\n", ranging, range_start, range_end);
+                core_select(1 - ranging);
+                if (!core_is_halted()) core_halt();
+                core_select(cur);
+                send_stop_packet(ranging+1, core_get_reason(ranging));
+                break;
+            }
+            core_select(cur);
+        }
         int rc = check_cores();
+        if (rc != -1 && action[rc] == CORE_RUN && action[1 - rc] != CORE_STEP
+                                    && action[1 - rc] != CORE_RANGE && bp_auto_resume(rc)) {
+            // Condition was false, so the other core needs to carry on too...
+            if (action[1 - rc] == CORE_RUN) {
+                core_select(1 - rc);
+                core_unhalt();
+                core_select(cur);
+            }
+            continue;
+        }
         if (rc != -1) {
             debug_printf("CORE %d has halted\r\n", rc);
             send_stop_packet(rc+1, core_get_reason(rc));
@@ -464,16 +1078,27 @@ GDBFUNC(vCont) {
             core_halt();
             return;
         }
-        // A simple yield here potentially doesn't give enough time to output
-        // pending debug etc. So nicer to have a small sleep. A few ms really shouldn't
-        // impact performance.
-        task_sleep_ms(2);;
         // If we have CTRL-C then we need to stop ourselves...
         if (io_peek_byte(gdb_io) == 0x03) {
             debug_printf("Have CTRL-C\r\n");
+            if (ranging != -1) {
+                // Consume it and empty the range, the next batch will then stop
+                // and report it as an interrupt...
+                io_get_byte(gdb_io);
+                gdb_intr = 1;
+                range_start = range_end = 0;
+                continue;
+            }
             core_halt();
             continue;
         }
+        // When range stepping we are already waiting on SWD, so don't slow it down
+        if (ranging != -1) continue;
+
+        // A simple yield here potentially doesn't give enough time to output
+        // pending debug etc. So nicer to have a small sleep. A few ms really shouldn't
+        // impact performance.
+        task_sleep_ms(2);;
     }
 }
 
@@ -494,23 +1119,30 @@ GDBFUNC(vFlashWrite) {
     packet += delta;
     len -= delta;
 
-    // TODO: look at whether we really need to do this ... does it actually make a
-    // difference ... if it does, then maybe a memmove back a few bytes will be better.
+    // Hand the payload over where it is (mem_write_block copes with it not being
+    // aligned) and switch to the other buffer for the next packet. Any errors will
+    // be reported at vFlashDone.
+    flash_queue_write(start & 0x00ffffff, (uint8_t *)packet, len);
+    gdb_buffer = (gdb_buffer == gdb_buffers[0]) ? gdb_buffers[1] : gdb_buffers[0];
 
-    // Make sure our source data is word aligned...
-    char *p = malloc(len);
-    if (!p)
-        lerp_panic("aarrgg");
-    memcpy(p, packet, len);
-    rp2040_add_flash_bit(start & 0x00ffffff, (uint8_t *)p, len);
-    free(p);
+    reply_ok();
+}
+
+GDBFUNC(vFlashErase) {
+    uint32_t start, len;
+    char *sep;
 
+    // Nothing is erased here, we just keep the range so we can erase ahead
+    start = strtoul(packet, &sep, 16);
+    if (*sep != ',') { reply_err(1); return; }
+    len = strtoul(sep + 1, NULL, 16);
+    flash_queue_erase(start & 0x00ffffff, len);
     reply_ok();
 }
 
 GDBFUNC(vFlashDone) {
     // Flush anything left...
-    rp2040_add_flash_bit(0xffffffff, NULL, 0);
+    if (flash_queue_done() != 0) { reply_err(1); return; }
     reply_ok();
 }
 
@@ -520,7 +1152,8 @@ GDBFUNC(ok)     { reply_ok(); }
 static const struct gdbitem gdb_v_items[] = {
     { "vMustReplyEmpty", 15, function_null, NULL, 0 },
     { "vCont", 5, function_vCont, NULL, 0 },
-    { "vFlashErase:", 12, function_ok, NULL, 0 },
+    { "vStopped", 8, function_vStopped, NULL, 0 },
+    { "vFlashErase:", 12, function_vFlashErase, NULL, 0 },
     { "vFlashWrite:", 12, function_vFlashWrite, NULL, 0 },
     { "vFlashDone", 10, function_vFlashDone, NULL, 0 },
     { NULL, 0, NULL, NULL, 0 },
@@ -539,7 +1172,10 @@ int thread_to_core(int thread) {
 
 void function_thread_valid(char *packet, int packet_size) {
     int tid = get_threadid(packet);
-    if (tid == 1 || tid == 2) reply_ok();
+    if (tid == 1 || tid == 2 || rtos_task_valid(tid)) {
+        reply_ok();
+        return;
+    }
     reply_err(1);
 }
 
@@ -550,7 +1186,14 @@ GDBFUNC(Hg) {       // Actually do a core switch
     int rc;
     int tid = get_threadid(packet);
     if (tid == 0) tid = 1;
-    if ((tid < 1) || (tid > 2)) { reply_err(1); return; }
+    if (tid > 2) {
+        // An RTOS task that isn't running, registers come from its stack
+        if (rtos_select(tid) != SWD_OK) { reply_err(1); return; }
+        reply_ok();
+        return;
+    }
+    if (tid < 1) { reply_err(1); return; }
+    rtos_select(0);
     rc = core_select(thread_to_core(tid));
     if (rc != SWD_OK) { reply_err(1); return; }
     reply_ok();
@@ -572,60 +1215,146 @@ char *xfer_features(int *len) {
     *len = sizeof(rp2040_features_xml);
     return (char *)rp2040_features_xml;
 }
+// The memory map is built once per session, so we can use the real flash size
+// and erase size. The XIP aliases are read only, and the peripherals are listed
+// so GDB will let us get at them.
+#define XFER_MEMORY_MAP_SIZE    1536
+
+static const char memory_map_fmt[] =
+    "<?xml version=\"1.0\"?>\n"
+    "<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" \"http://sourceware.org/gdb/gdb-memory-map.dtd\">\n"
+    "<memory-map>\n"
+    "<memory type=\"rom\" start=\"0x00000000\" length=\"0x4000\"/>\n"                 // bootrom
+    "<memory type=\"flash\" start=\"0x10000000\" length=\"0x%x\">\n"
+    "<property name=\"blocksize\">0x%x</property>\n"
+    "</memory>\n"
+    "<memory type=\"rom\" start=\"0x11000000\" length=\"0x%x\"/>\n"                   // XIP noalloc
+    "<memory type=\"rom\" start=\"0x12000000\" length=\"0x%x\"/>\n"                   // XIP nocache
+    "<memory type=\"rom\" start=\"0x13000000\" length=\"0x%x\"/>\n"                   // XIP nocache noalloc
+    "<memory type=\"ram\" start=\"0x14000000\" length=\"0x20\"/>\n"                   // XIP control
+    "<memory type=\"ram\" start=\"0x15000000\" length=\"0x4000\"/>\n"                 // XIP cache as SRAM
+    "<memory type=\"ram\" start=\"0x18000000\" length=\"0x100\"/>\n"                  // XIP SSI
+    "<memory type=\"ram\" start=\"0x20000000\" length=\"0x42000\"/>\n"                // SRAM (striped)
+    "<memory type=\"ram\" start=\"0x21000000\" length=\"0x40000\"/>\n"                // SRAM0-3 (not striped)
+    "<memory type=\"ram\" start=\"0x40000000\" length=\"0x70000\"/>\n"                // APB peripherals
+    "<memory type=\"ram\" start=\"0x50000000\" length=\"0x500000\"/>\n"               // AHB-lite (DMA, USB, PIO)
+    "<memory type=\"ram\" start=\"0xd0000000\" length=\"0x1000\"/>\n"                 // SIO
+    "<memory type=\"ram\" start=\"0xe0000000\" length=\"0x10000\"/>\n"                // PPB
+    "</memory-map>\n";
+
+static int memory_map_len = 0;      // zero means build it again
+
 char *xfer_memory_map(int *len) {
-    *len = sizeof(rp2040_memory_map_xml);
-    return (char *)rp2040_memory_map_xml;
+    static char *out = NULL;
+
+    if (!out) out = malloc(XFER_MEMORY_MAP_SIZE);
+    if (!out) lerp_panic("no memory");
+
+    if (!memory_map_len) {
+        uint32_t size, blocksize;
+
+        if (rp2040_flash_info(&size, &blocksize) != SWD_OK) {
+            debug_printf("unable to identify flash, using defaults\r\n");
+        }
+        memory_map_len = snprintf(out, XFER_MEMORY_MAP_SIZE, memory_map_fmt,
+                                    (unsigned int)size, (unsigned int)blocksize, (unsigned int)size,
+                                    (unsigned int)size, (unsigned int)size);
+    }
+    *len = memory_map_len;
+    return out;
 }
+// Room for the cores and plenty of RTOS tasks
+#define XFER_THREADS_SIZE       4096
+
 char *xfer_threads(int *len) {
     static const char *states[] = { "debug-request", "breakpoint", "watchpoint", 
                                     "breakpoint-and-watchpoint", "single-step", 
                                     "target-not-halted", "program-exit", "exception-catch",
                                     "undefined" };
     static char *out = NULL;
-    int r0 = core_get_reason(0);
-    int r1 = core_get_reason(1);
-    
-    if (!out) out = malloc(1024);       // TODO: fix this
+    int l;
+
+    if (!out) out = malloc(XFER_THREADS_SIZE);
     if (!out) lerp_panic("no memory");
-    *len = sprintf(out, "<?xml version=\"1.0\"?>\n<threads>\n"
-                 "<thread id=\"1\">Name: rp2040.core0, state: %s</thread>\n"
-                 "<thread id=\"2\">Name: rp2040.core1, state: %s</thread>\n"
-                 "</threads>\n",
-            states[r0], states[r1]);
+
+    // The cores (with the name of the task running on each) and then any other
+    // RTOS tasks...
+    l = sprintf(out, "<?xml version=\"1.0\"?>\n<threads>\n");
+    for (int i=0; i < 2; i++) {
+        const char *task = rtos_core_task(i);
+        l += sprintf(out + l, "<thread id=\"%d\">Name: rp2040.core%d%s%s, state: %s</thread>\n",
+                        i + 1, i, task ? " " : "", task ? task : "", states[core_get_reason(i)]);
+    }
+    l += rtos_threads(out + l, XFER_THREADS_SIZE - l - 16);
+    l += sprintf(out + l, "</threads>\n");
+    *len = l;
     return out;
 }
 
-GDBFUNC(qC) { reply_printf("QC%08x", core_get() + 1); }
+GDBFUNC(qC) { reply_printf("QC%08x", rtos_selected() ? rtos_selected() : (uint32_t)core_get() + 1); }
 GDBFUNC(qAttached) { reply("1", NULL, 0); }
 GDBFUNC(qSupported) {
     reply_printf("PacketSize=%x;qXfer:memory-map:read+;qXfer:features:read+;"
-                                "qXfer:threads:read+;QStartNoAckMode+;vContSupported+",
-                                        GDB_BUFFER_SIZE);
+                                "qXfer:threads:read+;QStartNoAckMode+;vContSupported+;QNonStop+;"
+                                "ConditionalBreakpoints+",
+                                        GDB_PACKET_SIZE);
 }
 GDBFUNC(qOffsets) { reply("Text=0;Data=0;Bss=0", NULL, 0); }
 
 // TODO: this is a temporary hack to support run_to_main
 static uint32_t symbol_main = 0;
 
+static int symbol_index = 0;       // which one we asked for last
+
 GDBFUNC(qSymbol) {
     // This is GDB either telling us it's prepared to serve symbols or a response to a previous
-    // reuqest. Format is qSymbol:: or qSymbol:hex_value:hex_name
+    // reuqest. Format is qSymbol:: or qSymbol:[hex_value]:hex_name
+    //
+    // We want main (for run_to_main) and then the RTOS symbols, we ask for them one
+    // at a time and finish with OK.
     if (*packet == ':' && packet_size == 1) {
-        // Initial qSymbol:: notification ... we want the value of main
-        reply("qSymbol:", (uint8_t *)"main", 4);
-        return;
+        symbol_index = 0;
+    } else {
+        char *sep;
+        uint32_t value = strtoul(packet, &sep, 16);
+        int have_value = (sep != packet);
+
+        if (*sep == ':' && have_value) {
+            int len = hex_to_bin(sep + 1);
+            if (len == 4 && !strncmp(sep + 1, "main", 4)) {
+                symbol_main = value;
+            } else {
+                rtos_symbol_value(sep + 1, len, value);
+            }
+            debug_printf("HAVE VALUE: %.*s=0x%08x\r\n", len, sep + 1, value);
+        }
+        symbol_index++;
     }
-    if (*packet == ':') {
-        // We didn't get a value
+    const char *name = symbol_index ? rtos_symbol_name(symbol_index - 1) : "main";
+    if (!name) {
         reply_ok();
         return;
     }
-    // This is a response... we'll assume it's for what we asked...
-    uint32_t value = strtoul(packet, NULL, 16);
-    symbol_main = value;
-    debug_printf("HAVE VALUE: 0x%08x\r\n", value);
+    reply("qSymbol:", (uint8_t *)name, strlen(name));
+}
+/**
+ * @brief qCRC:addr,length ... GDB wants a CRC32 of a block of memory (compare-sections)
+ * 
+ * This runs on the target where possible so that only the result needs to come back.
+ */
+GDBFUNC(qCRC) {
+    uint32_t    addr, len, crc;
+    char        *sep;
 
-    reply_ok();
+    addr = strtoul(packet, &sep, 16);
+    if (*sep != ',') { reply_err(1); return; }
+    len = strtoul(sep + 1, NULL, 16);
+
+    if (rp2040_crc32(addr, len, &crc) != SWD_OK) {
+        reply_err(1);
+        return;
+    }
+    reply_printf("C%08x", crc);
 }
 GDBFUNC(qXfer) {
     xfer_func   func = (xfer_func)ptr;
@@ -653,6 +1382,48 @@ GDBFUNC(qXfer) {
     }
     reply_part(symbol, p, length);
 }
+// -----------------------------------------------------------------------------------------------
+// Monitor commands (see monitor.c), output goes back as O packets while they run
+// -----------------------------------------------------------------------------------------------
+
+static void monitor_output(char *text, int len) {
+    reply("O", (uint8_t *)text, len);
+}
+
+static int mon_reset(char *args) {
+    if (*args && strcmp(args, "halt") != 0) {
+        mon_printf("only 'reset halt' is supported\n");
+        return SWD_ERROR;
+    }
+    return core_reset_halt();
+}
+
+static int mon_get_to_main(UNUSED char *args) {
+    int did_bp = 0;
+
+    if (!symbol_main) {
+        mon_printf("don't know where main is\n");
+        return SWD_ERROR;
+    }
+    if (!bp_is_set(symbol_main)) {
+    // TODO: check if we fail to add the breakpoint
+        bp_set(symbol_main);
+        did_bp = 1;
+    }
+    bp_sync();
+    core_unhalt();
+    for (int i=0; i < 200; i++) {
+        if (core_is_halted()) break;
+        task_sleep_ms(2);
+    }
+    if (!core_is_halted()) {
+        debug_printf("ERROR: failed to stop at main, stoppping now\r\n");
+        core_halt();
+    }
+    if (did_bp) bp_clr(symbol_main);
+    return SWD_OK;
+}
+
 GDBFUNC(qRcmd) {
     char *p = packet;
     int len = packet_size;
@@ -669,30 +1440,10 @@ GDBFUNC(qRcmd) {
         p += 2;
         packet[i] = b;
     }
+    packet[len] = 0;
     debug_printf("HAVE RCMD [%.*s]\r\n", len, packet);
 
-    if (strncmp(packet, "reset halt", 10) == 0) {
-        core_reset_halt();
-        reply_ok();
-        return;
-    } else if (strncmp(packet, "get_to_main", 11) == 0) {
-        int did_bp = 0;
-
-        if (!bp_is_set(symbol_main)) {
-        // TODO: check if we fail to add the breakpoint
-            bp_set(symbol_main);
-            did_bp = 1;
-        }
-        core_unhalt();
-        for (int i=0; i < 200; i++) {
-            if (core_is_halted()) break;
-            task_sleep_ms(2);
-        }
-        if (!core_is_halted()) {
-            debug_printf("ERROR: failed to stop at main, stoppping now\r\n");
-            core_halt();
-        }
-        if (did_bp) bp_clr(symbol_main);
+    if (monitor_run(packet, monitor_output) == SWD_OK) {
         reply_ok();
         return;
     }
@@ -701,6 +1452,75 @@ error:
 }
 
 
+GDBFUNC(QStartNoAckMode) {
+    reply_ok();
+    gdb_noack = 1;
+}
+
+// -----------------------------------------------------------------------------------------------
+// Tracepoints (collection is done on the probe, see trace.c)
+// -----------------------------------------------------------------------------------------------
+
+GDBFUNC(QTinit) {
+    trace_init();
+    reply_ok();
+}
+GDBFUNC(QTDP) {
+    if (trace_define(packet) != SWD_OK) { reply_err(1); return; }
+    reply_ok();
+}
+GDBFUNC(QTStart) {
+    if (trace_start() != SWD_OK) { reply_err(1); return; }
+    reply_ok();
+}
+GDBFUNC(QTStop) {
+    if (trace_stop() != SWD_OK) { reply_err(1); return; }
+    reply_ok();
+}
+GDBFUNC(QTBuffer) {
+    trace_set_buffer(packet);
+    reply_ok();
+}
+GDBFUNC(QTFrame) {
+    char buf[24];
+
+    trace_select_frame(packet, buf, sizeof(buf));
+    reply(buf, NULL, 0);
+}
+GDBFUNC(qTStatus) {
+    char buf[128];
+
+    trace_status(buf, sizeof(buf));
+    reply(buf, NULL, 0);
+}
+GDBFUNC(qTP) {
+    char buf[24];
+
+    if (!trace_tp_status(packet, buf, sizeof(buf))) { reply_err(1); return; }
+    reply(buf, NULL, 0);
+}
+GDBFUNC(qTP_upload) {
+    char buf[128];
+
+    if (!trace_upload(num, buf, sizeof(buf))) { reply("l", NULL, 0); return; }
+    reply(buf, NULL, 0);
+}
+GDBFUNC(l) { reply("l", NULL, 0); }
+
+static const struct gdbitem gdb_Q_items[] = {
+    { "QStartNoAckMode", 15, function_QStartNoAckMode, NULL, 0 },
+    { "QNonStop:", 9, function_QNonStop, NULL, 0 },
+    { "QTinit", 6, function_QTinit, NULL, 0 },
+    { "QTDP:", 5, function_QTDP, NULL, 0 },
+    { "QTStart", 7, function_QTStart, NULL, 0 },
+    { "QTStop", 6, function_QTStop, NULL, 0 },
+    { "QTFrame:", 8, function_QTFrame, NULL, 0 },
+    { "QTBuffer:", 9, function_QTBuffer, NULL, 0 },
+    { "QTro", 4, function_ok, NULL, 0 },
+    { "QTDisconnected:", 15, function_ok, NULL, 0 },
+    { NULL, 0, NULL, NULL, 0 },
+};
+
 struct gdbitem gdb_q_items[] = {
     { "qC", 2, function_qC, NULL, 0 },
     { "qAttached", 9, function_qAttached, NULL, 0 },
@@ -708,9 +1528,16 @@ struct gdbitem gdb_q_items[] = {
     { "qOffsets", 10, function_qOffsets, NULL, 0 },
     { "qRcmd,", 6, function_qRcmd, NULL, 0 },
     { "qSymbol:", 8, function_qSymbol, NULL, 0 },
+    { "qCRC:", 5, function_qCRC, NULL, 0 },
     { "qXfer:features:read:", 20, function_qXfer, (void *)xfer_features, 0 },
     { "qXfer:memory-map:read:", 22, function_qXfer, (void *)xfer_memory_map, 0 },
     { "qXfer:threads:read:", 19, function_qXfer, (void *)xfer_threads, 0 },
+    { "qTStatus", 8, function_qTStatus, NULL, 0 },
+    { "qTP:", 4, function_qTP, NULL, 0 },
+    { "qTfP", 4, function_qTP_upload, NULL, 1 },
+    { "qTsP", 4, function_qTP_upload, NULL, 0 },
+    { "qTfV", 4, function_l, NULL, 0 },
+    { "qTsV", 4, function_l, NULL, 0 },
     { NULL, 0, NULL, NULL, 0 },
 };
 
@@ -718,34 +1545,114 @@ struct gdbitem gdb_q_items[] = {
 // Breakpoint Related Packets (z/Z)
 // -----------------------------------------------------------------------------------------------
 
+/**
+ * @brief Decode any ";X<len>,<bytecode>" conditions after a Z0/Z1 into binary
+ *        form (each one prefixed with a length byte)
+ *
+ * Anything else (e.g. ";cmds") is ignored. Returns the total length or -1 on error.
+ * 
+ * @param p 
+ * @param out 
+ * @param max 
+ * @return int 
+ */
+static int decode_bp_conds(char *p, uint8_t *out, int max) {
+    int total = 0;
+
+    while (p && *p == ';') {
+        char *sep;
+        if (p[1] != 'X') break;
+        int len = strtoul(p + 2, &sep, 16);
+        if (*sep != ',' || len > 255 || total + len + 1 > max) return -1;
+        p = sep + 1;
+        out[total++] = len;
+        for (int i=0; i < len; i++) {
+            int b = hex_byte(p);
+            if (b < 0) return -1;
+            out[total++] = b;
+            p += 2;
+        }
+    }
+    return total;
+}
+
 GDBFUNC(z_hw) {
+    static uint8_t conds[128];
     int add = num;
     uint32_t addr, size;
-    if (!get_two_hex_numbers(packet, ',', &addr, &size)) { reply_err(1); return; }
+    char *p = get_two_hex_numbers(packet, ',', &addr, &size);
+    int clen = decode_bp_conds(p, conds, sizeof(conds));
+
+    if (!p || clen < 0) { reply_err(1); return; }
     if (add) {
-        if (bp_set(addr) != SWD_OK) reply_err(1);
+        if (bp_set(addr) != SWD_OK) { reply_err(1); return; }
+        if (bp_cond_set(addr, conds, clen) != SWD_OK) { reply_err(1); return; }
     } else {
-        if (bp_clr(addr) != SWD_OK) reply_err(1);
+        bp_cond_set(addr, NULL, 0);
+        if (bp_clr(addr) != SWD_OK) { reply_err(1); return; }
     }
     reply_ok();
 }
 GDBFUNC(z_sw) {
+    static uint8_t conds[128];
     int add = num;
     uint32_t addr, size;
-    if (!get_two_hex_numbers(packet, ',', &addr, &size)) { reply_err(1); return; }
+    char *p = get_two_hex_numbers(packet, ',', &addr, &size);
+    int clen = decode_bp_conds(p, conds, sizeof(conds));
+
+    if (!p || clen < 0) { reply_err(1); return; }
     if (add) {
-        if (sw_bp_set(addr, size) != SWD_OK) reply_err(1);
+        if (sw_bp_set(addr, size) != SWD_OK) { reply_err(1); return; }
+        if (bp_cond_set(addr, conds, clen) != SWD_OK) { reply_err(1); return; }
     } else {
-        if (sw_bp_clr(addr, size) != SWD_OK) reply_err(1);
+        bp_cond_set(addr, NULL, 0);
+        if (sw_bp_clr(addr, size) != SWD_OK) { reply_err(1); return; }
+    }
+    // Normally the target catches up when we resume, but in non-stop mode that
+    // might not be for a while so it needs doing now
+    if (gdb_nonstop && ns_any_running()) {
+        if (bp_sync() != SWD_OK) { reply_err(1); return; }
     }
     reply_ok();
 }
 
+/**
+ * @brief Watchpoints go on both cores since the memory is shared, num is add/remove
+ *        and ptr carries the type (WP_xxx)
+ */
+GDBFUNC(z_watch) {
+    int add = num;
+    int type = (int)(uintptr_t)ptr;
+    int cur = core_get();
+    int rc = SWD_OK;
+    uint32_t addr, size;
+
+    if (!get_two_hex_numbers(packet, ',', &addr, &size)) { reply_err(1); return; }
+    for (int i=0; i < 2 && rc == SWD_OK; i++) {
+        core_select(i);
+        rc = add ? wp_set(addr, size, type) : wp_clr(addr, size, type);
+    }
+    if (rc != SWD_OK && add) {
+        // Don't leave a half set watchpoint on the other core...
+        core_select(0);
+        wp_clr(addr, size, type);
+    }
+    core_select(cur);
+    if (rc != SWD_OK) { reply_err(1); return; }
+    reply_ok();
+}
+
 static const struct gdbitem gdb_z_items[] = {
     { "z0,", 3, function_z_sw, NULL, 0 },
     { "Z0,", 3, function_z_sw, NULL, 1 },
     { "z1,", 3, function_z_hw, NULL, 0 },
     { "Z1,", 3, function_z_hw, NULL, 1 },
+    { "z2,", 3, function_z_watch, (void *)WP_WRITE, 0 },
+    { "Z2,", 3, function_z_watch, (void *)WP_WRITE, 1 },
+    { "z3,", 3, function_z_watch, (void *)WP_READ, 0 },
+    { "Z3,", 3, function_z_watch, (void *)WP_READ, 1 },
+    { "z4,", 3, function_z_watch, (void *)WP_ACCESS, 0 },
+    { "Z4,", 3, function_z_watch, (void *)WP_ACCESS, 1 },
     { NULL, 0, NULL, NULL, 0 },
 };
 
@@ -765,6 +1672,65 @@ void process_table(const struct gdbitem *table, char *packet, int packet_size) {
     reply_null();
 }
 
+// -----------------------------------------------------------------------------------------------
+// Session setup, how we attach depends on gdb.attach:
+//
+// reset    - reset and halt both cores (the original behaviour)
+// halt     - halt both cores where they are
+// none     - leave them alone (for non-stop use, or just to look around)
+//
+// If the probe has already initialised the DP and the target is still powered and selected
+// then we skip the full dp_init() (see dp_attach.)
+// -----------------------------------------------------------------------------------------------
+
+static uint32_t session_start;          // when we saw the connection
+static uint32_t session_attach_us;      // how long the attach took
+static uint32_t session_prompt_us;      // time to the first '?' (i.e. GDB is nearly at the prompt)
+static int session_cached;              // did we reuse the previous DP state
+
+/**
+ * @brief In all-stop mode GDB expects everything to be stopped when it asks
+ */
+static void halt_running_cores() {
+    int cur = core_get();
+
+    for (int i=0; i < 2; i++) {
+        core_select(i);
+        if (core_is_halted() == 0) core_halt();
+    }
+    core_select(cur);
+}
+
+static int session_attach() {
+    CHECK_OK(dp_attach(&session_cached));
+
+    switch (cf->main->gdb.attach) {
+        case CF_ATTACH_NONE:
+            break;
+        case CF_ATTACH_HALT:
+            halt_running_cores();
+            break;
+        default:
+            for (int i=0; i < 2; i++) {
+                core_select(i);
+                core_reset_halt();
+            }
+            break;
+    }
+    core_select(0);
+    session_attach_us = time_us_32() - session_start;
+    debug_printf("ATTACH: mode=%d cached=%d took %dus\r\n", cf->main->gdb.attach, session_cached, session_attach_us);
+    return SWD_OK;
+}
+
+static int mon_session(UNUSED char *args) {
+    static const char *modes[] = { "reset", "halt", "none" };
+
+    mon_printf("session.attach mode=%s cached=%d attach_us=%u prompt_us=%u\n",
+                    modes[cf->main->gdb.attach % 3], session_cached, session_attach_us, session_prompt_us);
+    return SWD_OK;
+}
+
 void debug_packet(char *packet, int packet_size) {
     if (strncmp(packet, "vFlashWrite", 11) == 0) {
         char *p = packet + 12; // get past colon
@@ -778,7 +1744,7 @@ void debug_packet(char *packet, int packet_size) {
 }
 
 
-void process_packet(char *packet, int packet_size)
+static void dispatch_packet(char *packet, int packet_size)
 {
     // TODO: checksum
     if (!gdb_noack) io_put_byte(gdb_io, '+');
@@ -788,6 +1754,7 @@ void process_packet(char *packet, int packet_size)
     switch(*packet) {
         case 'm':   function_memread(packet+1); return;
         case 'M':   function_memwrite(packet+1); return;
+        case 'X':   function_binwrite(packet+1, packet_size-1); return;
         case 'p':   function_get_reg(packet+1); return;
         case 'P':   function_put_reg(packet+1); return;
         case 'g':   function_get_sys_regs(); return;
@@ -797,20 +1764,41 @@ void process_packet(char *packet, int packet_size)
         case 'z':   process_table(gdb_z_items, packet, packet_size); return;
         case 'Z':   process_table(gdb_z_items, packet, packet_size); return;
         case 'v':   process_table(gdb_v_items, packet, packet_size); return;
-        case '?':   reply("S00", NULL, 0); return;  // TODO
-    }
-
-    // the odd strange case left...
-    if (strncmp(packet, "QStartNoAckMode", 15) == 0) {
-        reply_ok();
-        gdb_noack = 1;
-        return;
+        case 'Q':   process_table(gdb_Q_items, packet, packet_size); return;
+        case '?':
+            if (!session_prompt_us) session_prompt_us = time_us_32() - session_start;
+            if (gdb_nonstop) { ns_report_stopped(); return; }
+            halt_running_cores();
+            reply("S00", NULL, 0); return;  // TODO
     }
 
     // Else not supported...
     reply_null();
 }
 
+/**
+ * @brief Process a packet, keeping track of how long it took and how much SWD
+ *        traffic it caused (see stats.c)
+ */
+void process_packet(char *packet, int packet_size) {
+    int type = stats_type(packet);
+
+    stats_start();
+    dispatch_packet(packet, packet_size);
+    stats_record(type, packet_size);
+}
+
+
+/**
+ * @brief Reply to a streamed packet (which has already been processed)
+ */
+static void stream_reply() {
+    if (!gdb_noack) io_put_byte(gdb_io, '+');
+    debug_printf("PKT [%c (streamed) %s]\r\n", st_type, st_error ? "failed" : "ok");
+    st_type = 0;
+    if (st_error) { reply_err(1); return; }
+    reply_ok();
+}
 
 // TODO: this isn't really a polling function ... more of a server!
 int gdb_poll() {
@@ -826,32 +1814,54 @@ int gdb_poll() {
     if (!was_connected) {
         // This is a new connection...
         debug_printf("NEW CONNECTION\r\n");
+        if (!session_start) session_start = time_us_32();
         // What other state do we care about?
         gdb_noack = 0;
+        gdb_nonstop = 0;
+        ns_reset();
+        trace_init();
+        sw_bp_reset();
+        rtos_init();
+        memory_map_len = 0;
+
+        session_prompt_us = 0;
 
-        if (dp_init() != SWD_OK) {
+        if (session_attach() != SWD_OK) {
             debug_printf("unable to connect to target, trying again...\r\n");
             task_sleep_ms(250);
             return 0;
         }
         was_connected = 1;
-
-        core_select(0);
-        core_reset_halt();
-        core_select(1);
-        core_reset_halt();
-        core_select(0);
     }
 
 
+    // In non-stop mode we need to keep an eye on the running cores, so we only
+    // go into build_packet (which blocks) when we have some input...
+    if (gdb_nonstop && ns_any_running()) {
+        ns_poll();
+        if (io_peek_byte(gdb_io) == -1) {
+            task_sleep_ms(2);
+            return 0;
+        }
+    }
+
     //tud_task();
     //refill_from_usb();
     rc = build_packet();
     if (rc != BP_RUNNING) {
         switch (rc) {
             case BP_PACKET:
+                // Memory can change under us if a core is running...
+                if (gdb_nonstop && ns_any_running()) mem_flush_cache();
+
+                // Anything other than more flash data needs the target to ourselves...
+                if (strncmp(gdb_buffer, "vFlashWrite:", 12) != 0) flash_queue_wait();
                 process_packet(gdb_buffer, gdb_blen);
                 break;
+            case BP_STREAMED:
+                stream_reply();
+                stats_record(stats_type(gdb_buffer), (st_payload - gdb_buffer) + st_bytes);
+                break;
             case BP_INTR:
                 debug_printf("Interrupt Received\r\n");
                 gdb_intr = 1;
@@ -870,10 +1880,15 @@ int gdb_poll() {
                 break;
             case BP_CHKSUM_FAIL:
                 debug_printf("CHKSUM FAIL\r\n");
+                if (!gdb_noack) io_put_byte(gdb_io, '-');
                 break;
             case BP_DISCONNECT:
                 debug_printf("DISCONNNECT\r\n");
+                // The next session might not reset, so don't leave breakpoints behind
+                flash_queue_wait();
+                sw_bp_remove_all();
                 was_connected = 0;
+                session_start = 0;
                 break;
             default:
                 debug_printf("RC=%d\r\n", rc);
@@ -900,4 +1915,12 @@ void func_gdbsvr(void *arg) {
 
 void gdb_init() {
         CREATE_TASK(gdbsvr, func_gdbsvr, NULL);
+        flash_queue_init();
+
+        monitor_init();
+        stats_init();
+        bp_init();
+        monitor_register("reset", "halt ... reset the target and stop", mon_reset);
+        monitor_register("get_to_main", "run until main and stop", mon_get_to_main);
+        monitor_register("session", "how the current GDB session attached and how long it took", mon_session);
 }
@@ -0,0 +1,113 @@
+/**
+ * @file lz.c
+ * @author Lee Essen (lee.essen@nowonline.co.uk)
+ * @brief 
+ * @version 0.1
+ * @date 2022-08-16
+ * 
+ * @copyright Copyright (c) 2022
+ * 
+ * Compressor for the LZ codec in lz.h, this is a simple greedy one with a small
+ * hash table, it only needs to be quicker than sending the data over SWD.
+ * 
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "lz.h"
+
+#define LZ_HASH_BITS        10
+#define LZ_MIN_MATCH        4
+#define LZ_MAX_OFFSET       65535
+
+static uint16_t lz_table[1 << LZ_HASH_BITS];
+
+static inline uint32_t lz_hash(uint8_t *p) {
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_extra(uint8_t *op, int n) {
+    while (n >= 255) {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = n;
+    return op;
+}
+
+/**
+ * @brief Output a sequence, mlen is the match length minus 4 (or -1 for none)
+ * 
+ * @return uint8_t*     the new output position, or NULL if it won't fit
+ */
+static uint8_t *lz_sequence(uint8_t *op, uint8_t *oend, uint8_t *lit, int nlit, int offset, int mlen) {
+    uint8_t *token = op;
+
+    if (op + 1 + (nlit / 255) + 1 + nlit + 2 + (MAX(mlen, 0) / 255) + 1 > oend) return NULL;
+
+    *op++ = MIN(nlit, 15) << 4;
+    if (nlit >= 15) op = lz_extra(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen < 0) return op;
+
+    *op++ = offset;
+    *op++ = offset >> 8;
+    *token |= MIN(mlen, 15);
+    if (mlen >= 15) op = lz_extra(op, mlen - 15);
+    return op;
+}
+
+/**
+ * @brief Compress len bytes into dst (which has max bytes of space)
+ * 
+ * @param src 
+ * @param len 
+ * @param dst 
+ * @param max 
+ * @return int      the compressed size, or zero if it doesn't fit in max (or
+ *                  couldn't be unpacked in place)
+ */
+int lz_compress(uint8_t *src, int len, uint8_t *dst, int max) {
+    uint8_t     *ip = src;
+    uint8_t     *anchor = src;
+    uint8_t     *end = src + len;
+    uint8_t     *op = dst;
+    uint8_t     *oend = dst + max;
+    int         slack = len;        // the most the compressed size can be for in place
+
+    memset(lz_table, 0, sizeof(lz_table));
+
+    while (ip + LZ_MIN_MATCH <= end) {
+        uint32_t    h = lz_hash(ip);
+        uint8_t     *ref = src + lz_table[h];
+
+        lz_table[h] = ip - src;
+        if (ref >= ip || (ip - ref) > LZ_MAX_OFFSET || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        // See how far it goes...
+        uint8_t *mp = ip + LZ_MIN_MATCH;
+        uint8_t *rp = ref + LZ_MIN_MATCH;
+        while (mp < end && *mp == *rp) {
+            mp++;
+            rp++;
+        }
+
+        op = lz_sequence(op, oend, anchor, ip - anchor, ip - ref, (mp - ip) - LZ_MIN_MATCH);
+        if (!op) return 0;
+        ip = anchor = mp;
+
+        // Unpacking in place mustn't write over anything it hasn't read yet
+        slack = MIN(slack, (end - ip) + (op - dst));
+    }
+    if (anchor < end) {
+        op = lz_sequence(op, oend, anchor, end - anchor, 0, -1);
+        if (!op) return 0;
+    }
+    if ((op - dst) > slack) return 0;
+    return op - dst;
+}
@@ -0,0 +1,46 @@
+
+#ifndef __LZ_H
+#define __LZ_H
+
+#include <stdint.h>
+
+//
+// A small LZ77 codec (the LZ4 block format) for sending flash data to the target.
+//
+// Each sequence is a token byte (high nibble literal count, low nibble match length
+// minus 4, 15 meaning more length bytes follow), the literals, then a two byte
+// little endian offset back into the output. The last sequence may stop after its
+// literals.
+//
+// The compressor makes sure the result can be unpacked in place, with the
+// compressed data at the end of the output area.
+//
+
+int lz_compress(uint8_t *src, int len, uint8_t *dst, int max);
+
+/**
+ * @brief Unpack len bytes from src into dst, this is inlined so it can be used
+ *        by the code that runs on the target.
+ */
+static inline __attribute__((always_inline)) void lz_decompress(uint8_t *src, int len, uint8_t *dst) {
+    uint8_t *end = src + len;
+
+    while (src < end) {
+        int     token = *src++;
+        int     n = token >> 4;
+        int     b;
+
+        if (n == 15) do { b = *src++; n += b; } while (b == 255);
+        while (n--) *dst++ = *src++;
+        if (src >= end) break;
+
+        uint8_t *m = dst - (src[0] | (src[1] << 8));
+        src += 2;
+        n = token & 15;
+        if (n == 15) do { b = *src++; n += b; } while (b == 255);
+        n += 4;
+        while (n--) *dst++ = *m++;
+    }
+}
+
+#endif
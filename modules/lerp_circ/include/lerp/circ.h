@@ -82,7 +82,6 @@ static inline int circ_space(struct circ *c) {
 }
 
 static inline int circ_space_before_wrap(struct circ *c) {
-    if (c->tail < c->head) return 0;
     return MIN(circ_space(c), c->end - c->head);
 }
 
@@ -14,6 +14,7 @@
 #include "lerp/flash.h"
 #include "lerp/debug.h"
 #include "hardware/flash.h"
+#include "hardware/sync.h"
 #include "pico/bootrom.h"
 
 // We use dynamic memory for re-writing the superblock
@@ -110,8 +111,10 @@ void __no_inline_not_in_flash_func(flash_program)(void *ptr, void *buffer, size_
         }
     }
 
-    // STAGE 3: Turn of XIP
+    // STAGE 3: Turn of XIP ... nothing can run from flash until stage 7, so
+    // make sure an interrupt (USB, network) can't get in while it's gone
     flash_init_boot2_copyout();
+    uint32_t irq = save_and_disable_interrupts();
     __compiler_memory_barrier();
     connect_internal_flash();
     flash_exit_xip();
@@ -159,6 +162,7 @@ void __no_inline_not_in_flash_func(flash_program)(void *ptr, void *buffer, size_
 
     // STAGE 7: turn XIP back on
     flash_enable_xip_via_boot2();
+    restore_interrupts(irq);
 }
 
 
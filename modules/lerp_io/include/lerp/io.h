@@ -46,6 +46,8 @@ void io_poll();
 int io_get_byte(struct io *io);
 int io_put_byte(struct io *io, uint8_t ch);
 int io_put_hexbyte(struct io *io, uint8_t b);
+uint8_t *io_reserve(struct io *io, int *space);
+void io_commit(struct io *io, int count);
 int io_printf(struct io *io, char *format, ...);
 int io_aprintf(struct io *io, char *format, va_list args);
 int io_peek_byte(struct io *io);
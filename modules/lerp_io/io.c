@@ -369,6 +369,33 @@ int io_put_byte(struct io *io, uint8_t ch) {
     return 0;
 }
 
+/**
+ * @brief Get direct access to the contiguous free space at the head of the output
+ *        buffer (blocking until there is some), the caller fills in up to space bytes
+ *        and then calls io_commit() with the number actually used.
+ * 
+ * Returns NULL if we were woken for some other reason (e.g. disconnect)
+ * 
+ * @param io 
+ * @param space 
+ * @return uint8_t* 
+ */
+uint8_t *io_reserve(struct io *io, int *space) {
+    int reason;
+
+    while (circ_is_full(io->output)) {
+        io->waiting_on_output = current_task();
+        reason = task_block();
+        if (reason < 0) return NULL;
+    }
+    *space = circ_space_before_wrap(io->output);
+    return io->output->head;
+}
+
+void io_commit(struct io *io, int count) {
+    if (count) circ_advance_head(io->output, count);
+}
+
 int io_read_flush(struct io *io) {
     if (io->usb_is_connected) tud_cdc_n_read_flush(io->cdc_port);
     circ_clean(io->input);
@@ -0,0 +1,288 @@
+/**
+ * @file monitor.c
+ * @author Lee Essen (lee.essen@nowonline.co.uk)
+ * @brief
+ * @version 0.1
+ * @date 2022-08-11
+ *
+ * @copyright Copyright (c) 2022
+ *
+ * Support for GDB "monitor" commands (qRcmd) ... commands are registered with
+ * a name and some help text, and anything they print is sent straight back to
+ * the caller (as O packets for GDB) while the command is running.
+ *
+ * There are also some built in benchmarks so we can see how the probe is
+ * performing from inside GDB. Each result is a single line:
+ *
+ * bench.<name> count=<n> bytes=<n> time_us=<n> rate=<n> unit=<B/s|ops/s>
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include "pico/stdlib.h"
+#include "pico/printf.h"
+#include "lerp/debug.h"
+#include "monitor.h"
+#include "flash.h"
+#include "swd.h"
+#include "adi.h"
+
+#define MON_MAX_COMMANDS    16
+#define MON_LINE_SIZE       256
+
+#define UNUSED              __attribute__ ((unused))
+
+struct mon_cmd {
+    char        *name;
+    char        *help;
+    mon_func    func;
+};
+
+static struct mon_cmd   commands[MON_MAX_COMMANDS];
+static int              command_count = 0;
+static mon_output       mon_out = NULL;
+
+/**
+ * @brief Add a command to the list, returns SWD_ERROR if there's no space
+ *
+ * @param name
+ * @param help
+ * @param func
+ * @return int
+ */
+int monitor_register(char *name, char *help, mon_func func) {
+    for (int i=0; i < command_count; i++) {
+        if (!strcmp(commands[i].name, name)) {
+            commands[i].help = help;
+            commands[i].func = func;
+            return SWD_OK;
+        }
+    }
+    if (command_count == MON_MAX_COMMANDS) return SWD_ERROR;
+    commands[command_count].name = name;
+    commands[command_count].help = help;
+    commands[command_count].func = func;
+    command_count++;
+    return SWD_OK;
+}
+
+/**
+ * @brief Output from a command, this goes straight back to whoever ran it
+ *
+ * @param format
+ * @param ...
+ * @return int
+ */
+static char mon_line[MON_LINE_SIZE];
+static int  mon_len;
+
+static void _mon_out(char ch, UNUSED void *arg) {
+    if (mon_len < MON_LINE_SIZE) mon_line[mon_len++] = ch;
+}
+
+int mon_printf(char *format, ...) {
+    va_list args;
+    int     len;
+
+    mon_len = 0;
+    va_start(args, format);
+    len = vfctprintf(_mon_out, NULL, format, args);
+    va_end(args);
+
+    if (mon_out && mon_len) mon_out(mon_line, mon_len);
+    return len;
+}
+
+/**
+ * @brief Find and run a command, line is "name [args]" and must be zero
+ *        terminated.
+ *
+ * @param line
+ * @param output
+ * @return int
+ */
+int monitor_run(char *line, mon_output output) {
+    char    *args;
+    int     len;
+    int     rc;
+
+    while (*line == ' ') line++;
+    args = strchr(line, ' ');
+    len = args ? (args - line) : (int)strlen(line);
+    if (args) {
+        while (*args == ' ') args++;
+    } else {
+        args = line + len;
+    }
+
+    for (int i=0; i < command_count; i++) {
+        if (strlen(commands[i].name) == len && !strncmp(commands[i].name, line, len)) {
+            mon_out = output;
+            rc = commands[i].func(args);
+            mon_out = NULL;
+            return rc;
+        }
+    }
+    mon_out = output;
+    mon_printf("unknown command: %.*s (try help)\n", len, line);
+    mon_out = NULL;
+    return SWD_ERROR;
+}
+
+// -----------------------------------------------------------------------------------
+// Built in commands
+// -----------------------------------------------------------------------------------
+
+static int mon_help(char *args) {
+    for (int i=0; i < command_count; i++) {
+        mon_printf("%-12s %s\n", commands[i].name, commands[i].help);
+    }
+    return SWD_OK;
+}
+
+// -----------------------------------------------------------------------------------
+// Benchmarks
+// -----------------------------------------------------------------------------------
+
+#define BENCH_SWD_OPS       2000
+#define BENCH_REG_OPS       500
+#define BENCH_MEM_ADDR      0x20000000
+#define BENCH_MEM_SIZE      65536
+#define BENCH_BLOCK         4096
+#define BENCH_FLASH_SIZE    65536
+
+static uint8_t bench_buf[BENCH_BLOCK];
+
+/**
+ * @brief One line per result, if bytes is zero then the rate is operations
+ */
+static void bench_result(char *name, uint32_t count, uint32_t bytes, uint32_t us) {
+    uint32_t rate = us ? (uint32_t)(((uint64_t)(bytes ? bytes : count) * 1000000) / us) : 0;
+
+    mon_printf("bench.%s count=%u bytes=%u time_us=%u rate=%u unit=%s\n", name,
+                                    count, bytes, us, rate, bytes ? "B/s" : "ops/s");
+}
+
+static int bench_need_halted() {
+    if (core_is_halted() == 1) return SWD_OK;
+    mon_printf("bench: the target needs to be halted for this\n");
+    return SWD_ERROR;
+}
+
+static int bench_swd() {
+    uint32_t    t, v;
+
+    // DPIDR reads and null ABORT writes are single transactions with no side effects
+    t = time_us_32();
+    for (int i=0; i < BENCH_SWD_OPS; i++) CHECK_OK(swd_read(0, 0, &v));
+    bench_result("swd_read", BENCH_SWD_OPS, 0, time_us_32() - t);
+
+    t = time_us_32();
+    for (int i=0; i < BENCH_SWD_OPS; i++) CHECK_OK(swd_write(0, 0, 0));
+    bench_result("swd_write", BENCH_SWD_OPS, 0, time_us_32() - t);
+    return SWD_OK;
+}
+
+static int bench_mem() {
+    uint32_t    t, read_us = 0, write_us = 0;
+
+    CHECK_OK(bench_need_halted());
+
+    // Read each block and write the same thing back, so nothing changes
+    for (uint32_t addr = BENCH_MEM_ADDR; addr < BENCH_MEM_ADDR + BENCH_MEM_SIZE; addr += BENCH_BLOCK) {
+        t = time_us_32();
+        CHECK_OK(mem_read_block(addr, BENCH_BLOCK, bench_buf));
+        read_us += time_us_32() - t;
+
+        t = time_us_32();
+        CHECK_OK(mem_write_block(addr, BENCH_BLOCK, bench_buf));
+        write_us += time_us_32() - t;
+    }
+    bench_result("mem_read", BENCH_MEM_SIZE / BENCH_BLOCK, BENCH_MEM_SIZE, read_us);
+    bench_result("mem_write", BENCH_MEM_SIZE / BENCH_BLOCK, BENCH_MEM_SIZE, write_us);
+    return SWD_OK;
+}
+
+static int bench_reg() {
+    uint32_t    t, v;
+
+    CHECK_OK(bench_need_halted());
+
+    t = time_us_32();
+    for (int i=0; i < BENCH_REG_OPS; i++) CHECK_OK(reg_read(0, &v));
+    bench_result("reg_read", BENCH_REG_OPS, 0, time_us_32() - t);
+
+    t = time_us_32();
+    for (int i=0; i < BENCH_REG_OPS; i++) CHECK_OK(reg_write(0, v));
+    bench_result("reg_write", BENCH_REG_OPS, 0, time_us_32() - t);
+    return SWD_OK;
+}
+
+/**
+ * @brief Flash rates, this erases and programs the 64K at offset (and leaves
+ *        it erased) and uses target RAM, so it's only run if asked for.
+ */
+static int bench_flash(uint32_t offset) {
+    uint32_t    t, crc_data, crc_flash;
+
+    CHECK_OK(bench_need_halted());
+    if (offset & (BENCH_FLASH_SIZE - 1)) {
+        mon_printf("bench: flash offset must be 64K aligned\n");
+        return SWD_ERROR;
+    }
+
+    // Fill the target data buffer with a pattern to program...
+    for (int i=0; i < BENCH_BLOCK; i++) bench_buf[i] = (i * 7) ^ (i >> 8);
+    for (int i=0; i < BENCH_FLASH_SIZE; i += BENCH_BLOCK) {
+        CHECK_OK(mem_write_block(rp2040_flash_buffer() + i, BENCH_BLOCK, bench_buf));
+    }
+
+    t = time_us_32();
+    CHECK_OK(rp2040_flash_erase(offset, BENCH_FLASH_SIZE));
+    bench_result("flash_erase", 1, BENCH_FLASH_SIZE, time_us_32() - t);
+
+    t = time_us_32();
+    CHECK_OK(rp2040_flash_program(offset, BENCH_FLASH_SIZE));
+    bench_result("flash_program", 1, BENCH_FLASH_SIZE, time_us_32() - t);
+
+    // Compare is what we do for every chunk, this reads it all on the target
+    CHECK_OK(rp2040_crc32(rp2040_flash_buffer(), BENCH_FLASH_SIZE, &crc_data));
+    t = time_us_32();
+    CHECK_OK(rp2040_crc32(0x10000000 + offset, BENCH_FLASH_SIZE, &crc_flash));
+    bench_result("flash_compare", 1, BENCH_FLASH_SIZE, time_us_32() - t);
+
+    CHECK_OK(rp2040_flash_erase(offset, BENCH_FLASH_SIZE));
+    if (crc_data != crc_flash) {
+        mon_printf("bench: flash verify failed (0x%08x != 0x%08x)\n", crc_flash, crc_data);
+        return SWD_ERROR;
+    }
+    return SWD_OK;
+}
+
+/**
+ * @brief bench [swd|mem|reg|all] or bench flash <offset>
+ */
+static int mon_bench(char *args) {
+    int all = (!*args || !strcmp(args, "all"));
+    int done = 0;
+
+    if (all || !strcmp(args, "swd")) { CHECK_OK(bench_swd()); done++; }
+    if (all || !strcmp(args, "mem")) { CHECK_OK(bench_mem()); done++; }
+    if (all || !strcmp(args, "reg")) { CHECK_OK(bench_reg()); done++; }
+    if (!strncmp(args, "flash ", 6)) {
+        CHECK_OK(bench_flash(strtoul(args + 6, NULL, 16)));
+        done++;
+    }
+    if (!done) {
+        mon_printf("usage: bench [swd|mem|reg|all] or bench flash <hex offset>\n");
+        return SWD_ERROR;
+    }
+    return SWD_OK;
+}
+
+void monitor_init() {
+    monitor_register("help", "list the monitor commands", mon_help);
+    monitor_register("bench", "[swd|mem|reg|all] or flash <offset> (erases 64K there)", mon_bench);
+}
@@ -0,0 +1,15 @@
+
+#ifndef __MONITOR_H
+#define __MONITOR_H
+
+#include <stdint.h>
+
+typedef int (*mon_func)(char *args);
+typedef void (*mon_output)(char *text, int len);
+
+void monitor_init();
+int monitor_register(char *name, char *help, mon_func func);
+int monitor_run(char *line, mon_output output);
+int mon_printf(char *format, ...);
+
+#endif
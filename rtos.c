@@ -0,0 +1,346 @@
+/**
+ * @file rtos.c
+ * @author Lee Essen (lee.essen@nowonline.co.uk)
+ * @brief
+ * @version 0.1
+ * @date 2022-08-09
+ *
+ * @copyright Copyright (c) 2022
+ *
+ * FreeRTOS thread awareness ... we get the addresses of the kernel lists from
+ * GDB (using qSymbol) and then walk them ourselves so each task can be shown
+ * to GDB as a thread.
+ *
+ * The two cores are still threads 1 and 2 (and they show the name of the task
+ * that is running on them), every other task is a thread with its TCB address
+ * as the thread id. Registers for those come from the frame that the port
+ * saved on the task stack when it was switched out.
+ *
+ * Walking the lists costs a block read per list header and one per task (which
+ * picks up the list links and the name together), the result is cached until
+ * something resumes a core (see rtos_invalidate.)
+ *
+ * We assume the standard 32 bit layout without MPU or list integrity checks:
+ *
+ * List_t       uxNumberOfItems, pxIndex, xListEnd { xItemValue, pxNext, pxPrevious }
+ * ListItem_t   xItemValue, pxNext, pxPrevious, pvOwner, pxContainer
+ * TCB_t        pxTopOfStack, xStateListItem, xEventListItem, uxPriority, pxStack,
+ *              [xTaskRunState, xIsIdle/uxTaskAttributes (SMP)], pcTaskName
+ *
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/printf.h"
+#include "lerp/debug.h"
+#include "rtos.h"
+#include "swd.h"
+#include "adi.h"
+
+#define RTOS_MAX_TASKS      48
+#define RTOS_MAX_PRIORITIES 32
+#define RTOS_NAME_LEN       16          // configMAX_TASK_NAME_LEN
+
+#define LIST_SIZE           20
+#define LIST_END            8           // offset of xListEnd in List_t
+#define ITEM_NEXT           4           // offset of pxNext in ListItem_t
+#define ITEM_OWNER          12          // offset of pvOwner in ListItem_t
+
+#define TCB_STATE_ITEM      4
+#define TCB_EVENT_ITEM      24
+#define TCB_NAME            52
+#define TCB_NAME_SMP        60
+#define TCB_READ            (TCB_NAME_SMP + RTOS_NAME_LEN)
+
+// Saved frame at pxTopOfStack: r4-r11 (pushed by PendSV) then the exception frame
+#define FRAME_WORDS         16
+
+enum {
+    SYM_CURRENT_TCB = 0,
+    SYM_CURRENT_TCBS,
+    SYM_READY_LISTS,
+    SYM_DELAYED_1,
+    SYM_DELAYED_2,
+    SYM_PENDING_READY,
+    SYM_SUSPENDED,
+    SYM_TERMINATION,
+    SYM_TOP_PRIORITY,
+    SYM_COUNT
+};
+
+static const char *symbol_names[SYM_COUNT] = {
+    "pxCurrentTCB", "pxCurrentTCBs", "pxReadyTasksLists", "xDelayedTaskList1",
+    "xDelayedTaskList2", "xPendingReadyList", "xSuspendedTaskList",
+    "xTasksWaitingTermination", "uxTopUsedPriority",
+};
+static uint32_t symbols[SYM_COUNT];
+
+struct task_info {
+    uint32_t    tcb;                    // also the thread id
+    uint32_t    top;                    // pxTopOfStack
+    const char  *state;
+    char        name[RTOS_NAME_LEN + 1];
+};
+
+static struct task_info tasks[RTOS_MAX_TASKS];
+static int          task_count = 0;
+static uint32_t     current[2];         // running TCB on each core
+static char         current_name[2][RTOS_NAME_LEN + 1];
+static int          cache_valid = 0;
+
+static uint32_t     selected = 0;       // task thread we are looking at (0 = a core)
+static uint32_t     frame[FRAME_WORDS];
+static int          frame_valid = 0;
+
+static inline uint32_t word_at(uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+
+/**
+ * @brief Copy a task name out of a TCB block, anything that would upset the
+ *        thread list xml is replaced.
+ */
+static void copy_name(char *dest, uint8_t *src) {
+    int i;
+
+    for (i=0; i < RTOS_NAME_LEN && src[i]; i++) {
+        char ch = src[i];
+        dest[i] = (ch < ' ' || ch > '~' || strchr("<>&\"", ch)) ? '_' : ch;
+    }
+    dest[i] = 0;
+}
+
+static int name_offset() {
+    return symbols[SYM_CURRENT_TCBS] ? TCB_NAME_SMP : TCB_NAME;
+}
+
+static struct task_info *find_task(uint32_t tcb) {
+    for (int i=0; i < task_count; i++) {
+        if (tasks[i].tcb == tcb) return &tasks[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Walk one kernel list (header already read) adding the tasks on it
+ *
+ * @param list      address of the list on the target
+ * @param hdr       the LIST_SIZE bytes of the list
+ * @param item_off  which list item in the TCB links it into this list
+ * @param state     description for the thread list
+ * @return int
+ */
+static int walk_list(uint32_t list, uint8_t *hdr, int item_off, const char *state) {
+    uint8_t     tcb[TCB_READ];
+    uint32_t    count = word_at(hdr);
+    uint32_t    item = word_at(hdr + LIST_END + ITEM_NEXT);
+
+    while (count-- && item != list + LIST_END && task_count < RTOS_MAX_TASKS) {
+        uint32_t base = item - item_off;
+
+        CHECK_OK(mem_read_block(base, TCB_READ, tcb));
+        if (word_at(tcb + item_off + ITEM_OWNER) != base) {
+            debug_printf("RTOS: list item at 0x%08x is not in a TCB\r\n", item);
+            return SWD_ERROR;
+        }
+        item = word_at(tcb + item_off + ITEM_NEXT);
+
+        for (int i=0; i < 2; i++) {
+            if (base == current[i]) copy_name(current_name[i], tcb + name_offset());
+        }
+        if (base == current[0] || base == current[1] || find_task(base)) continue;
+
+        struct task_info *t = &tasks[task_count++];
+        t->tcb = base;
+        t->top = word_at(tcb);
+        t->state = state;
+        copy_name(t->name, tcb + name_offset());
+    }
+    return SWD_OK;
+}
+
+static int walk_symbol_list(int sym, int item_off, const char *state) {
+    uint8_t hdr[LIST_SIZE];
+
+    if (!symbols[sym]) return SWD_OK;       // not in this build
+    CHECK_OK(mem_read_block(symbols[sym], LIST_SIZE, hdr));
+    return walk_list(symbols[sym], hdr, item_off, state);
+}
+
+/**
+ * @brief Build the task cache (if it isn't already valid for this halt)
+ */
+static int rtos_refresh() {
+    static uint8_t  ready[RTOS_MAX_PRIORITIES * LIST_SIZE];
+    uint32_t        top;
+
+    if (cache_valid) return SWD_OK;
+    task_count = 0;
+    current[0] = current[1] = 0;
+    current_name[0][0] = current_name[1][0] = 0;
+
+    if (!rtos_active()) {
+        cache_valid = 1;
+        return SWD_OK;
+    }
+    if (symbols[SYM_CURRENT_TCBS]) {
+        CHECK_OK(mem_read_block(symbols[SYM_CURRENT_TCBS], sizeof(current), (uint8_t *)current));
+    } else {
+        CHECK_OK(mem_read32(symbols[SYM_CURRENT_TCB], &current[0]));
+    }
+    if (current[0] || current[1]) {
+        // The scheduler is running, all the ready lists come in one go...
+        CHECK_OK(mem_read32(symbols[SYM_TOP_PRIORITY], &top));
+        top = MIN(top + 1, RTOS_MAX_PRIORITIES);
+        CHECK_OK(mem_read_block(symbols[SYM_READY_LISTS], top * LIST_SIZE, ready));
+        for (int p = top - 1; p >= 0; p--) {
+            if (!word_at(ready + (p * LIST_SIZE))) continue;
+            CHECK_OK(walk_list(symbols[SYM_READY_LISTS] + (p * LIST_SIZE), ready + (p * LIST_SIZE),
+                                                                    TCB_STATE_ITEM, "Ready"));
+        }
+        CHECK_OK(walk_symbol_list(SYM_PENDING_READY, TCB_EVENT_ITEM, "Ready"));
+        CHECK_OK(walk_symbol_list(SYM_DELAYED_1, TCB_STATE_ITEM, "Blocked"));
+        CHECK_OK(walk_symbol_list(SYM_DELAYED_2, TCB_STATE_ITEM, "Blocked"));
+        CHECK_OK(walk_symbol_list(SYM_SUSPENDED, TCB_STATE_ITEM, "Suspended"));
+        CHECK_OK(walk_symbol_list(SYM_TERMINATION, TCB_STATE_ITEM, "Deleted"));
+    }
+    debug_printf("RTOS: found %d tasks (plus running)\r\n", task_count);
+    cache_valid = 1;
+    return SWD_OK;
+}
+
+// -----------------------------------------------------------------------------------
+// Symbols (from qSymbol)
+// -----------------------------------------------------------------------------------
+
+void rtos_init() {
+    memset(symbols, 0, sizeof(symbols));
+    rtos_invalidate();
+    selected = 0;
+}
+
+/**
+ * @brief Return the name of the nth symbol we want GDB to look up, NULL at the end
+ */
+const char *rtos_symbol_name(int n) {
+    return (n >= 0 && n < SYM_COUNT) ? symbol_names[n] : NULL;
+}
+
+/**
+ * @brief Record a symbol value that GDB has given us
+ *
+ * @param name      name (not terminated)
+ * @param len       length of name
+ * @param value
+ */
+void rtos_symbol_value(char *name, int len, uint32_t value) {
+    for (int i=0; i < SYM_COUNT; i++) {
+        if (strlen(symbol_names[i]) == len && !strncmp(symbol_names[i], name, len)) {
+            symbols[i] = value;
+            rtos_invalidate();
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Do we have enough symbols to walk the task lists?
+ */
+int rtos_active() {
+    return (symbols[SYM_CURRENT_TCB] || symbols[SYM_CURRENT_TCBS])
+                            && symbols[SYM_READY_LISTS] && symbols[SYM_TOP_PRIORITY];
+}
+
+// -----------------------------------------------------------------------------------
+// Threads
+// -----------------------------------------------------------------------------------
+
+/**
+ * @brief Forget everything we know about the tasks, needed whenever a core is
+ *        resumed or memory is changed.
+ */
+void rtos_invalidate() {
+    cache_valid = 0;
+    frame_valid = 0;
+}
+
+/**
+ * @brief The name of the task running on a core (or NULL)
+ */
+const char *rtos_core_task(int core) {
+    if (rtos_refresh() != SWD_OK) return NULL;
+    return (current[core] && current_name[core][0]) ? current_name[core] : NULL;
+}
+
+/**
+ * @brief Add the (not running) tasks to the thread list xml
+ *
+ * @param buf
+ * @param size
+ * @return int      number of characters added
+ */
+int rtos_threads(char *buf, int size) {
+    int len = 0;
+
+    if (rtos_refresh() != SWD_OK) return 0;
+    for (int i=0; i < task_count; i++) {
+        int n = snprintf(buf + len, size - len, "<thread id=\"%x\">Name: %s, state: %s</thread>\n",
+                                    (unsigned int)tasks[i].tcb, tasks[i].name, tasks[i].state);
+        if (n >= size - len) break;         // out of space, just leave the rest off
+        len += n;
+    }
+    return len;
+}
+
+int rtos_task_valid(uint32_t tid) {
+    if (rtos_refresh() != SWD_OK) return 0;
+    return find_task(tid) != NULL;
+}
+
+/**
+ * @brief Select a task thread (or 0 to go back to the cores)
+ */
+int rtos_select(uint32_t tid) {
+    if (tid && !rtos_task_valid(tid)) return SWD_ERROR;
+    if (tid != selected) frame_valid = 0;
+    selected = tid;
+    return SWD_OK;
+}
+
+uint32_t rtos_selected() {
+    return selected;
+}
+
+/**
+ * @brief Read a register for the selected task from its saved frame
+ *
+ * @param reg
+ * @param value
+ * @return int
+ */
+int rtos_task_reg(int reg, uint32_t *value) {
+    struct task_info *t;
+
+    CHECK_OK(rtos_refresh());
+    t = find_task(selected);
+    if (!t) return SWD_ERROR;
+    if (!frame_valid) {
+        CHECK_OK(mem_read_block(t->top, sizeof(frame), (uint8_t *)frame));
+        frame_valid = 1;
+    }
+    switch(reg) {
+        case 0 ... 3:   *value = frame[8 + reg]; break;
+        case 4 ... 11:  *value = frame[reg - 4]; break;
+        case 12:        *value = frame[12]; break;
+        case 14:        *value = frame[13]; break;
+        case 15:        *value = frame[14]; break;
+        case 16:        *value = frame[15]; break;
+        case 13:
+        case 18:        // sp (and psp) is what it was before the frame was pushed
+            *value = t->top + sizeof(frame) + ((frame[15] & (1 << 9)) ? 4 : 0);
+            break;
+        default:
+            return SWD_ERROR;
+    }
+    return SWD_OK;
+}
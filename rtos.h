@@ -0,0 +1,20 @@
+
+#ifndef __RTOS_H
+#define __RTOS_H
+
+#include <stdint.h>
+
+void rtos_init();
+const char *rtos_symbol_name(int n);
+void rtos_symbol_value(char *name, int len, uint32_t value);
+int rtos_active();
+
+void rtos_invalidate();
+const char *rtos_core_task(int core);
+int rtos_threads(char *buf, int size);
+int rtos_task_valid(uint32_t tid);
+int rtos_select(uint32_t tid);
+uint32_t rtos_selected();
+int rtos_task_reg(int reg, uint32_t *value);
+
+#endif
@@ -0,0 +1,169 @@
+/**
+ * @file stats.c
+ * @author Lee Essen (lee.essen@nowonline.co.uk)
+ * @brief
+ * @version 0.1
+ * @date 2022-08-12
+ *
+ * @copyright Copyright (c) 2022
+ *
+ * Per packet type statistics for the GDB server, so we can see what is
+ * actually taking the time in a slow debug session.
+ *
+ * For each type we keep the count, bytes received, total and max wall time,
+ * how many SWD transactions (and WAIT retries) it caused, and a histogram of
+ * the latency where bucket n is 2^n to 2^(n+1)-1 microseconds (bucket 0 also
+ * has anything under 1us.)
+ *
+ * Note that vCont includes the time the target was running.
+ *
+ * Each type is output as a single line:
+ *
+ * stats.<type> count=<n> bytes=<n> time_ms=<n> max_us=<n> swd=<n> retries=<n> hist=<n>,<n>,...
+ *
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/printf.h"
+#include "lerp/debug.h"
+#include "stats.h"
+#include "monitor.h"
+#include "swd.h"
+
+#define HIST_BUCKETS        24          // up to about 16 seconds
+
+enum {
+    PS_MEMREAD = 0, PS_MEMWRITE, PS_BINWRITE, PS_REGS, PS_REGREAD, PS_REGWRITE,
+    PS_VCONT, PS_FLASHWRITE, PS_BREAKPOINT, PS_XFER, PS_OTHER, PS_COUNT
+};
+
+static const char *type_names[PS_COUNT] = {
+    "m", "M", "X", "g", "p", "P", "vCont", "vFlashWrite", "Z/z", "qXfer", "other",
+};
+
+struct pstat {
+    uint32_t    count;
+    uint32_t    bytes;
+    uint64_t    time_us;
+    uint32_t    max_us;
+    uint32_t    swd;
+    uint32_t    retries;
+    uint32_t    hist[HIST_BUCKETS];
+};
+
+static struct pstat stats[PS_COUNT];
+
+// Snapshot at the start of the current packet
+static uint32_t     start_time;
+static uint32_t     start_xfers;
+static uint32_t     start_retries;
+
+/**
+ * @brief Work out which type a packet is
+ */
+int stats_type(char *packet) {
+    switch(*packet) {
+        case 'm':   return PS_MEMREAD;
+        case 'M':   return PS_MEMWRITE;
+        case 'X':   return PS_BINWRITE;
+        case 'g':   return PS_REGS;
+        case 'p':   return PS_REGREAD;
+        case 'P':   return PS_REGWRITE;
+        case 'Z':
+        case 'z':   return PS_BREAKPOINT;
+        case 'v':
+            if (strncmp(packet, "vCont", 5) == 0) return PS_VCONT;
+            if (strncmp(packet, "vFlashWrite", 11) == 0) return PS_FLASHWRITE;
+            break;
+        case 'q':
+            if (strncmp(packet, "qXfer", 5) == 0) return PS_XFER;
+            break;
+    }
+    return PS_OTHER;
+}
+
+/**
+ * @brief Called when we start processing a packet
+ */
+void stats_start() {
+    start_time = time_us_32();
+    swd_get_counts(&start_xfers, &start_retries);
+}
+
+/**
+ * @brief Called when the packet is finished with
+ *
+ * @param type
+ * @param bytes
+ */
+void stats_record(int type, int bytes) {
+    struct pstat    *ps = &stats[type];
+    uint32_t        us = time_us_32() - start_time;
+    uint32_t        xfers, retries;
+    int             bucket = 0;
+
+    swd_get_counts(&xfers, &retries);
+
+    ps->count++;
+    ps->bytes += bytes;
+    ps->time_us += us;
+    ps->max_us = MAX(ps->max_us, us);
+    ps->swd += xfers - start_xfers;
+    ps->retries += retries - start_retries;
+
+    while ((us >>= 1) && bucket < HIST_BUCKETS - 1) bucket++;
+    ps->hist[bucket]++;
+}
+
+void stats_reset() {
+    memset(stats, 0, sizeof(stats));
+}
+
+/**
+ * @brief Format the line for the nth type into buf
+ *
+ * @param n
+ * @param buf
+ * @param size
+ * @return int      length of the line, or 0 if there are no more
+ */
+int stats_line(int n, char *buf, int size) {
+    struct pstat    *ps;
+    int             len, last;
+
+    if (n < 0 || n >= PS_COUNT) return 0;
+    ps = &stats[n];
+
+    len = snprintf(buf, size, "stats.%s count=%u bytes=%u time_ms=%u max_us=%u swd=%u retries=%u hist=",
+                    type_names[n], ps->count, ps->bytes, (uint32_t)(ps->time_us / 1000), ps->max_us,
+                    ps->swd, ps->retries);
+
+    // Only go as far as the last bucket that has something in it
+    for (last = HIST_BUCKETS - 1; last > 0 && !ps->hist[last]; last--);
+    for (int i=0; i <= last && len < size; i++) {
+        len += snprintf(buf + len, size - len, i ? ",%u" : "%u", ps->hist[i]);
+    }
+    return MIN(len, size - 1);
+}
+
+// -----------------------------------------------------------------------------------
+// Monitor command
+// -----------------------------------------------------------------------------------
+
+static int mon_stats(char *args) {
+    char    line[256];
+    int     n = 0;
+
+    if (strcmp(args, "reset") == 0) {
+        stats_reset();
+        mon_printf("stats reset\n");
+        return SWD_OK;
+    }
+    while (stats_line(n++, line, sizeof(line))) mon_printf("%s\n", line);
+    return SWD_OK;
+}
+
+void stats_init() {
+    monitor_register("stats", "[reset] ... per packet type counts, timings and SWD usage", mon_stats);
+}
@@ -0,0 +1,14 @@
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <stdint.h>
+
+void stats_init();
+int stats_type(char *packet);
+void stats_start();
+void stats_record(int type, int bytes);
+void stats_reset();
+int stats_line(int n, char *buf, int size);
+
+#endif
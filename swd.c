@@ -30,6 +30,15 @@ static uint                 swd_sm;
 static struct task *waiting_on_put = NULL;
 static struct task *waiting_on_get = NULL;
 
+// Transaction counts (for the packet stats), a retry is a WAIT response
+static uint32_t swd_xfers = 0;
+static uint32_t swd_retries = 0;
+
+void swd_get_counts(uint32_t *xfers, uint32_t *retries) {
+    *xfers = swd_xfers;
+    *retries = swd_retries;
+}
+
 /**
  * @brief Blocking (lerp_task) version of pio_sm_put
  * 
@@ -276,6 +285,8 @@ int swd_read(int APnDP, int addr, uint32_t *result) {
 
     do {
         rc = _swd_read(APnDP, addr, result);
+        swd_xfers++;
+        if (rc == SWD_WAIT) swd_retries++;
     } while (rc == SWD_WAIT);
     return rc;
 }
@@ -343,6 +354,8 @@ int swd_write(int APnDP, int addr, uint32_t value) {
 
     do {
         rc = _swd_write(APnDP, addr, value);
+        swd_xfers++;
+        if (rc == SWD_WAIT) swd_retries++;
     } while (rc == SWD_WAIT);
     return rc;
 }
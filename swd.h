@@ -25,6 +25,7 @@ void swd_pio_poll();
 void swd_targetsel(uint32_t target);
 int swd_read(int APnDP, int addr, uint32_t *result);
 int swd_write(int APnDP, int addr, uint32_t value);
+void swd_get_counts(uint32_t *xfers, uint32_t *retries);
 void swd_send_bits(uint32_t *data, int bitcount);
 
 void swd_line_reset();
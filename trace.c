@@ -0,0 +1,689 @@
+/**
+ * @file trace.c
+ * @author Lee Essen (lee.essen@nowonline.co.uk)
+ * @brief
+ * @version 0.1
+ * @date 2022-08-04
+ *
+ * @copyright Copyright (c) 2022
+ *
+ * Tracepoint support ... GDB defines the tracepoints (QTDP) and what to collect
+ * at each one (registers, memory, or agent expressions) and we do the collection
+ * on the probe when the breakpoint is hit, then let the target carry on.
+ *
+ * The frames are kept in a buffer in probe RAM and GDB looks at them later by
+ * selecting a frame (QTFrame) and then reading registers and memory as normal.
+ *
+ * Frame format in the buffer (all fields are memcpy'd, no alignment):
+ *
+ * uint16_t     tracepoint number
+ * uint16_t     total frame size (including this header)
+ * blocks...    'R' + 19 x uint32_t registers
+ *              'M' + uint32_t addr + uint16_t len + data
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "pico/printf.h"
+#include "lerp/debug.h"
+#include "trace.h"
+#include "agent.h"
+#include "breakpoint.h"
+#include "utils.h"
+#include "swd.h"
+#include "adi.h"
+
+#define TP_MAX              8
+#define TP_ACTIONS          8
+#define TP_CODE_BYTES       48
+#define TP_REGS             19          // r0-r15, xpsr, msp, psp
+
+#define TRACE_BUF_SIZE      16384
+#define FRAME_HDR_SIZE      4
+
+#define TP_HW(core)         (1 << (core))
+#define TP_SW               (1 << 2)
+
+struct tpaction {
+    int         type;                   // R, M or X
+    int         basereg;                // M: base register (-1 for absolute)
+    uint32_t    offset;                 // M: offset from base register, R: mask
+    uint32_t    len;                    // M: length to collect, X: bytecode length
+    uint8_t     code[TP_CODE_BYTES];
+};
+
+struct tracepoint {
+    int         num;                    // zero means unused
+    uint32_t    addr;
+    int         enabled;
+    int         installed;              // what we actually put in (TP_HW(core), TP_SW)
+    uint32_t    pass;                   // stop tracing after this many hits (0=never)
+
+    uint32_t    hits;
+    uint32_t    bytes;                  // how much buffer have we used
+
+    int         clen;                   // condition (if any)
+    uint8_t     cond[TP_CODE_BYTES];
+
+    int         nactions;
+    struct tpaction actions[TP_ACTIONS];
+};
+
+static struct tracepoint tracepoints[TP_MAX];
+
+enum { TSTOP_NOTRUN = 0, TSTOP_USER, TSTOP_FULL, TSTOP_PASSCOUNT, TSTOP_ERROR };
+
+static int          trace_running = 0;
+static int          trace_stop_reason = TSTOP_NOTRUN;
+static int          trace_stop_tp = 0;
+static int          trace_circular = 0;
+
+static uint8_t      trace_buf[TRACE_BUF_SIZE];
+static int          trace_used = 0;             // completed frames plus the current one
+static int          trace_frame_start = 0;      // offset of the frame being built
+static int          trace_frames = 0;           // how many frames in the buffer
+static int          trace_created = 0;          // how many have we ever created
+static int          trace_full = 0;             // did we run out of space
+
+static int          trace_selected = -1;        // frame selected by QTFrame
+static int          trace_selected_pos = 0;     // ... and where it is
+
+static struct tracepoint *find_tp(int num, uint32_t addr) {
+    for (int i=0; i < TP_MAX; i++) {
+        if (tracepoints[i].num == num && tracepoints[i].addr == addr) return &tracepoints[i];
+    }
+    return NULL;
+}
+
+static struct tracepoint *find_tp_by_addr(uint32_t addr) {
+    for (int i=0; i < TP_MAX; i++) {
+        if (tracepoints[i].num && tracepoints[i].enabled && tracepoints[i].addr == addr) return &tracepoints[i];
+    }
+    return NULL;
+}
+
+static int decode_code(char *p, uint8_t *code, int max, char **end) {
+    char *sep;
+    int len = strtoul(p, &sep, 16);
+
+    if (*sep != ',' || len > max) return -1;
+    p = sep + 1;
+    for (int i=0; i < len; i++) {
+        int b = hex_byte(p);
+        if (b < 0) return -1;
+        code[i] = b;
+        p += 2;
+    }
+    *end = p;
+    return len;
+}
+
+// ---------------------------------------------------------------------------------
+// Buffer management
+// ---------------------------------------------------------------------------------
+
+static void buffer_clear() {
+    trace_used = trace_frame_start = 0;
+    trace_frames = trace_created = 0;
+    trace_full = 0;
+    trace_selected = -1;
+}
+
+/**
+ * @brief Make sure we have space for n more bytes in the current frame, in circular
+ *        mode we drop the oldest frames to make it.
+ */
+static int frame_room(int n) {
+    while (trace_used + n > TRACE_BUF_SIZE) {
+        uint16_t size;
+
+        if (!trace_circular || trace_frame_start == 0) {
+            trace_full = 1;
+            return 0;
+        }
+
+        memcpy(&size, trace_buf + 2, sizeof(uint16_t));
+        memmove(trace_buf, trace_buf + size, trace_used - size);
+        trace_used -= size;
+        trace_frame_start -= size;
+        trace_frames--;
+        trace_selected = -1;
+    }
+    return 1;
+}
+
+static int frame_add(void *data, int len) {
+    if (!frame_room(len)) return 0;
+    memcpy(trace_buf + trace_used, data, len);
+    trace_used += len;
+    return 1;
+}
+
+/**
+ * @brief Collect a block of target memory into the frame (also used as the
+ *        trace callback for agent expressions)
+ */
+static int collect_mem(uint32_t addr, int len) {
+    uint8_t type = 'M';
+    uint16_t len16 = len;
+
+    if (len <= 0 || len > 0xffff) return SWD_ERROR;
+    if (!frame_room(1 + 4 + 2 + len)) return SWD_ERROR;
+
+    frame_add(&type, 1);
+    frame_add(&addr, 4);
+    frame_add(&len16, 2);
+    CHECK_OK(mem_read_block(addr, len, trace_buf + trace_used));
+    trace_used += len;
+    return SWD_OK;
+}
+
+static int collect_regs() {
+    uint8_t type = 'R';
+    uint32_t value;
+
+    if (!frame_room(1 + TP_REGS * 4)) return SWD_ERROR;
+    frame_add(&type, 1);
+    for (int i=0; i < TP_REGS; i++) {
+        CHECK_OK(reg_read(i, &value));
+        frame_add(&value, 4);
+    }
+    return SWD_OK;
+}
+
+static int collect_action(struct tpaction *a) {
+    uint32_t base = 0;
+    int64_t result;
+
+    switch(a->type) {
+        case 'R':
+            return collect_regs();
+        case 'M':
+            if (a->basereg != -1) CHECK_OK(reg_read(a->basereg, &base));
+            return collect_mem(base + a->offset, a->len);
+        case 'X':
+            return agent_eval(a->code, a->len, collect_mem, &result);
+    }
+    return SWD_ERROR;
+}
+
+// ---------------------------------------------------------------------------------
+// Tracepoint definitions (QTinit, QTDP)
+// ---------------------------------------------------------------------------------
+
+void trace_init() {
+    if (trace_running) trace_stop();
+    memset(tracepoints, 0, sizeof(tracepoints));
+    buffer_clear();
+    trace_stop_reason = TSTOP_NOTRUN;
+}
+
+/**
+ * @brief Parse an action string (R, M or X) and add it to the tracepoint
+ */
+static int add_action(struct tracepoint *tp, char *p, char **end) {
+    struct tpaction *a;
+    char *sep;
+
+    if (tp->nactions == TP_ACTIONS) return SWD_ERROR;
+    a = &tp->actions[tp->nactions];
+    a->type = *p++;
+
+    switch(a->type) {
+        case 'R':
+            a->offset = strtoul(p, &sep, 16);
+            break;
+        case 'M':
+            if (*p == '-') {
+                a->basereg = -1;
+                sep = p + 2;
+            } else {
+                a->basereg = strtoul(p, &sep, 16);
+            }
+            if (*sep != ',') return SWD_ERROR;
+            sep = get_two_hex_numbers(sep + 1, ',', &a->offset, &a->len);
+            if (!sep) return SWD_ERROR;
+            break;
+        case 'X':
+            a->len = decode_code(p, a->code, TP_CODE_BYTES, &sep);
+            if ((int)a->len < 0) return SWD_ERROR;
+            break;
+        default:
+            return SWD_ERROR;
+    }
+    tp->nactions++;
+    *end = sep;
+    return SWD_OK;
+}
+
+/**
+ * @brief Process a QTDP packet (after the colon), either a new tracepoint
+ *        n:addr:E|D:step:pass[:Xlen,cond] or actions for one -n:addr:actions
+ *
+ * @param packet
+ * @return int
+ */
+int trace_define(char *packet) {
+    struct tracepoint *tp;
+    char *p = packet;
+    int num;
+    uint32_t addr;
+
+    if (*p == '-') {
+        // Actions for an existing tracepoint...
+        num = strtoul(p + 1, &p, 16);
+        if (*p != ':') return SWD_ERROR;
+        addr = strtoul(p + 1, &p, 16);
+        if (*p++ != ':') return SWD_ERROR;
+        tp = find_tp(num, addr);
+        if (!tp) return SWD_ERROR;
+
+        if (*p == 'S') {
+            debug_printf("TRACE: while-stepping actions not supported\r\n");
+            return SWD_OK;
+        }
+        while (*p && *p != '-') {
+            CHECK_OK(add_action(tp, p, &p));
+        }
+        return SWD_OK;
+    }
+
+    num = strtoul(p, &p, 16);
+    if (*p != ':' || !num) return SWD_ERROR;
+    addr = strtoul(p + 1, &p, 16);
+    if (*p != ':') return SWD_ERROR;
+
+    // Find a free slot (replacing any existing one)...
+    tp = find_tp(num, addr);
+    if (!tp) tp = find_tp(0, 0);
+    if (!tp) return SWD_ERROR;
+    memset(tp, 0, sizeof(struct tracepoint));
+
+    tp->num = num;
+    tp->addr = addr;
+    tp->enabled = (p[1] == 'E');
+    p += 3;
+    strtoul(p, &p, 16);                     // step count (not supported)
+    if (*p == ':') tp->pass = strtoul(p + 1, &p, 16);
+
+    // Optional fast tracepoint size and condition...
+    while (*p == ':') {
+        p++;
+        if (*p == 'F') {
+            strtoul(p + 1, &p, 16);
+        } else if (*p == 'X') {
+            tp->clen = decode_code(p + 1, tp->cond, TP_CODE_BYTES, &p);
+            if (tp->clen < 0) return SWD_ERROR;
+        } else {
+            break;
+        }
+    }
+    return SWD_OK;
+}
+
+// ---------------------------------------------------------------------------------
+// Running the trace
+// ---------------------------------------------------------------------------------
+
+/**
+ * @brief Put in (or take out) the breakpoints for all the enabled tracepoints
+ *
+ * Flash addresses need hardware breakpoints (on both cores), RAM ones can be
+ * software breakpoints. We only take out what we put in, GDB may have its own
+ * breakpoints at the same addresses.
+ */
+static int trace_breakpoints(int set) {
+    int cur = core_get();
+    int rc = SWD_OK;
+
+    for (int i=0; i < TP_MAX && rc == SWD_OK; i++) {
+        struct tracepoint *tp = &tracepoints[i];
+        if (!tp->num) continue;
+
+        if (!set) {
+            for (int c=0; c < 2 && rc == SWD_OK; c++) {
+                if (!(tp->installed & TP_HW(c))) continue;
+                core_select(c);
+                rc = bp_clr(tp->addr);
+                if (rc == SWD_OK) tp->installed &= ~TP_HW(c);
+            }
+            if (rc == SWD_OK && (tp->installed & TP_SW)) {
+                rc = sw_bp_trace(tp->addr, 2, 0);
+                if (rc == SWD_OK) tp->installed &= ~TP_SW;
+            }
+            continue;
+        }
+        if (!tp->enabled || tp->installed) continue;
+
+        if (tp->addr < 0x20000000) {
+            for (int c=0; c < 2 && rc == SWD_OK; c++) {
+                core_select(c);
+                rc = bp_set(tp->addr);
+                if (rc == SWD_OK) tp->installed |= TP_HW(c);
+            }
+        } else {
+            rc = sw_bp_trace(tp->addr, 2, 1);
+            if (rc == SWD_OK) tp->installed |= TP_SW;
+        }
+    }
+    core_select(cur);
+
+    // Software ones only get put in (or taken out) when we sync...
+    if (rc == SWD_OK) rc = bp_sync();
+    return rc;
+}
+
+int trace_start() {
+    buffer_clear();
+    for (int i=0; i < TP_MAX; i++) {
+        tracepoints[i].hits = tracepoints[i].bytes = 0;
+    }
+    if (trace_breakpoints(1) != SWD_OK) {
+        trace_breakpoints(0);
+        return SWD_ERROR;
+    }
+    trace_running = 1;
+    return SWD_OK;
+}
+
+static int trace_end(int reason, int tpnum) {
+    if (!trace_running) return SWD_OK;
+    trace_running = 0;
+    trace_stop_reason = reason;
+    trace_stop_tp = tpnum;
+    return trace_breakpoints(0);
+}
+
+int trace_stop() {
+    return trace_end(TSTOP_USER, 0);
+}
+
+int trace_is_running() {
+    return trace_running;
+}
+
+/**
+ * @brief Does GDB have a breakpoint of its own at addr (as well as a tracepoint)?
+ *        The core needs to be selected.
+ */
+int trace_shared_bp(uint32_t addr) {
+    struct tracepoint *tp = find_tp_by_addr(addr);
+    int ours = (tp && (tp->installed & TP_HW(core_get()))) ? 1 : 0;
+
+    if (sw_bp_is_user(addr)) return 1;
+    return (bp_is_set(addr) > ours);
+}
+
+/**
+ * @brief Called when a core has stopped on a breakpoint at addr (with the core
+ *        selected), if it's one of our tracepoints we collect a frame.
+ *
+ * Returns 1 if it was a tracepoint (so the core should be resumed), 0 if not.
+ *
+ * @param addr
+ * @return int
+ */
+int trace_hit(uint32_t addr) {
+    struct tracepoint *tp;
+    int64_t result;
+    uint16_t hdr[2];
+    int rc = SWD_OK;
+
+    if (!trace_running) return 0;
+    tp = find_tp_by_addr(addr);
+    if (!tp) return 0;
+
+    // If we have a condition then check it first...
+    if (tp->clen) {
+        if (agent_eval(tp->cond, tp->clen, NULL, &result) != SWD_OK) {
+            trace_end(TSTOP_ERROR, tp->num);
+            return 1;
+        }
+        if (!result) return 1;
+    }
+    tp->hits++;
+
+    // Start the frame, we fill in the size at the end...
+    trace_frame_start = trace_used;
+    hdr[0] = tp->num;
+    hdr[1] = 0;
+    if (!frame_add(hdr, FRAME_HDR_SIZE)) rc = SWD_ERROR;
+
+    for (int i=0; i < tp->nactions && rc == SWD_OK; i++) {
+        rc = collect_action(&tp->actions[i]);
+    }
+    if (rc != SWD_OK) {
+        // Throw away the partial frame...
+        trace_used = trace_frame_start;
+        trace_end(trace_full ? TSTOP_FULL : TSTOP_ERROR, tp->num);
+        return 1;
+    }
+    hdr[1] = trace_used - trace_frame_start;
+    memcpy(trace_buf + trace_frame_start, hdr, FRAME_HDR_SIZE);
+    tp->bytes += hdr[1];
+    trace_frames++;
+    trace_created++;
+
+    if (tp->pass && tp->hits >= tp->pass) trace_end(TSTOP_PASSCOUNT, tp->num);
+    return 1;
+}
+
+// ---------------------------------------------------------------------------------
+// Status and upload
+// ---------------------------------------------------------------------------------
+
+int trace_status(char *buf, int size) {
+    char reason[24];
+
+    switch(trace_stop_reason) {
+        case TSTOP_NOTRUN:      strcpy(reason, "tnotrun:0"); break;
+        case TSTOP_USER:        strcpy(reason, "tstop::0"); break;
+        case TSTOP_FULL:        strcpy(reason, "tfull:0"); break;
+        case TSTOP_PASSCOUNT:   snprintf(reason, sizeof(reason), "tpasscount:%x", trace_stop_tp); break;
+        default:                snprintf(reason, sizeof(reason), "terror::%x", trace_stop_tp); break;
+    }
+    return snprintf(buf, size, "T%d;%s;tframes:%x;tcreated:%x;tfree:%x;tsize:%x;circular:%d;disconn:0",
+                        trace_running, trace_running ? "tnotrun:0" : reason, trace_frames, trace_created,
+                        TRACE_BUF_SIZE - trace_used, TRACE_BUF_SIZE, trace_circular);
+}
+
+/**
+ * @brief qTP:tp:addr returns the hit count and buffer usage
+ */
+int trace_tp_status(char *packet, char *buf, int size) {
+    uint32_t num, addr;
+    struct tracepoint *tp;
+
+    if (!get_two_hex_numbers(packet, ':', &num, &addr)) return 0;
+    tp = find_tp(num, addr);
+    if (!tp) return 0;
+    return snprintf(buf, size, "V%x:%x", (unsigned int)tp->hits, (unsigned int)tp->bytes);
+}
+
+/**
+ * @brief qTfP/qTsP upload the definitions one item per packet, the tracepoint
+ *        first and then each of its actions. Returns 0 when there is no more.
+ */
+int trace_upload(int first, char *buf, int size) {
+    static int tpi, acti;
+    struct tracepoint *tp;
+    struct tpaction *a;
+    int len;
+
+    if (first) { tpi = 0; acti = -1; }
+
+    while (tpi < TP_MAX) {
+        tp = &tracepoints[tpi];
+        if (!tp->num || acti >= tp->nactions) {
+            tpi++; acti = -1;
+            continue;
+        }
+        if (acti == -1) {
+            acti++;
+            return snprintf(buf, size, "T%x:%x:%c:0:%x", tp->num, (unsigned int)tp->addr,
+                                                tp->enabled ? 'E' : 'D', (unsigned int)tp->pass);
+        }
+        a = &tp->actions[acti++];
+        len = snprintf(buf, size, "A%x:%x:", tp->num, (unsigned int)tp->addr);
+        switch(a->type) {
+            case 'R':
+                return len + snprintf(buf + len, size - len, "R%x", (unsigned int)a->offset);
+            case 'M':
+                if (a->basereg == -1) {
+                    return len + snprintf(buf + len, size - len, "M-1,%x,%x", (unsigned int)a->offset, (unsigned int)a->len);
+                }
+                return len + snprintf(buf + len, size - len, "M%x,%x,%x", a->basereg, (unsigned int)a->offset, (unsigned int)a->len);
+            case 'X':
+                len += snprintf(buf + len, size - len, "X%x,", (unsigned int)a->len);
+                for (int i=0; i < a->len && len + 3 < size; i++) {
+                    len += snprintf(buf + len, size - len, "%02x", a->code[i]);
+                }
+                return len;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief QTBuffer:circular:n (other buffer options are accepted and ignored)
+ */
+int trace_set_buffer(char *packet) {
+    if (strncmp(packet, "circular:", 9) == 0) {
+        trace_circular = (packet[9] == '1');
+    }
+    return SWD_OK;
+}
+
+// ---------------------------------------------------------------------------------
+// Frame selection and access
+// ---------------------------------------------------------------------------------
+
+static inline int frame_tpnum(int pos) {
+    uint16_t v;
+    memcpy(&v, trace_buf + pos, sizeof(uint16_t));
+    return v;
+}
+static inline int frame_size(int pos) {
+    uint16_t v;
+    memcpy(&v, trace_buf + pos + 2, sizeof(uint16_t));
+    return v;
+}
+static uint32_t frame_pc(int pos) {
+    struct tracepoint *tp;
+
+    for (int i=0; i < TP_MAX; i++) {
+        tp = &tracepoints[i];
+        if (tp->num == frame_tpnum(pos)) return tp->addr;
+    }
+    return 0;
+}
+
+/**
+ * @brief Process QTFrame:n, QTFrame:pc:addr, QTFrame:tdp:t, QTFrame:range:start:end
+ *        and QTFrame:outside:start:end ... searches start after the current frame.
+ *
+ * Fills buf with the reply (F<frame>T<tp> or F-1)
+ */
+int trace_select_frame(char *packet, char *buf, int size) {
+    enum { BY_NUM, BY_PC, BY_TDP, BY_RANGE, BY_OUTSIDE };
+    int mode;
+    uint32_t v1 = 0, v2 = 0;
+    int frame = 0;
+    int pos = 0;
+
+    if (strncmp(packet, "pc:", 3) == 0) {
+        mode = BY_PC; v1 = strtoul(packet + 3, NULL, 16);
+    } else if (strncmp(packet, "tdp:", 4) == 0) {
+        mode = BY_TDP; v1 = strtoul(packet + 4, NULL, 16);
+    } else if (strncmp(packet, "range:", 6) == 0) {
+        mode = BY_RANGE; get_two_hex_numbers(packet + 6, ':', &v1, &v2);
+    } else if (strncmp(packet, "outside:", 8) == 0) {
+        mode = BY_OUTSIDE; get_two_hex_numbers(packet + 8, ':', &v1, &v2);
+    } else {
+        mode = BY_NUM; v1 = strtol(packet, NULL, 16);
+    }
+
+    while (pos < trace_used && frame < trace_frames) {
+        uint32_t pc = frame_pc(pos);
+        int match = 0;
+
+        switch(mode) {
+            case BY_NUM:        match = (frame == (int)v1); break;
+            case BY_PC:         match = (pc == v1); break;
+            case BY_TDP:        match = (frame_tpnum(pos) == (int)v1); break;
+            case BY_RANGE:      match = (pc >= v1 && pc <= v2); break;
+            case BY_OUTSIDE:    match = (pc < v1 || pc > v2); break;
+        }
+        if (match && (mode == BY_NUM || frame > trace_selected)) {
+            trace_selected = frame;
+            trace_selected_pos = pos;
+            return snprintf(buf, size, "F%xT%x", frame, frame_tpnum(pos));
+        }
+        pos += frame_size(pos);
+        frame++;
+    }
+    trace_selected = -1;
+    return snprintf(buf, size, "F-1");
+}
+
+int trace_frame_selected() {
+    return (trace_selected != -1);
+}
+
+/**
+ * @brief Find a block of a given type within the selected frame, returns the
+ *        offset of the data (after the type) or -1.
+ */
+static int frame_find_block(int type, int start) {
+    int end = trace_selected_pos + frame_size(trace_selected_pos);
+    int pos = (start == -1) ? trace_selected_pos + FRAME_HDR_SIZE : start;
+
+    while (pos < end) {
+        int t = trace_buf[pos++];
+        uint16_t len;
+
+        if (t == type) return pos;
+        if (t == 'R') {
+            pos += TP_REGS * 4;
+        } else {
+            memcpy(&len, trace_buf + pos + 4, sizeof(uint16_t));
+            pos += 4 + 2 + len;
+        }
+    }
+    return -1;
+}
+
+int trace_frame_reg(int reg, uint32_t *value) {
+    int pos = frame_find_block('R', -1);
+
+    if (pos == -1 || reg >= TP_REGS) {
+        // We always know the pc...
+        if (reg == 15) {
+            *value = frame_pc(trace_selected_pos);
+            return SWD_OK;
+        }
+        return SWD_ERROR;
+    }
+    memcpy(value, trace_buf + pos + (reg * 4), sizeof(uint32_t));
+    return SWD_OK;
+}
+
+int trace_frame_mem(uint32_t addr, int len, uint8_t *dest) {
+    int pos = -1;
+
+    while ((pos = frame_find_block('M', pos)) != -1) {
+        uint32_t baddr;
+        uint16_t blen;
+
+        memcpy(&baddr, trace_buf + pos, sizeof(uint32_t));
+        memcpy(&blen, trace_buf + pos + 4, sizeof(uint16_t));
+        if (addr >= baddr && addr + len <= baddr + blen) {
+            memcpy(dest, trace_buf + pos + 6 + (addr - baddr), len);
+            return SWD_OK;
+        }
+        pos += 6 + blen;
+    }
+    return SWD_ERROR;
+}
@@ -0,0 +1,25 @@
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+void trace_init();
+int trace_define(char *packet);
+int trace_start();
+int trace_stop();
+int trace_is_running();
+int trace_hit(uint32_t addr);
+int trace_shared_bp(uint32_t addr);
+
+int trace_status(char *buf, int size);
+int trace_tp_status(char *packet, char *buf, int size);
+int trace_upload(int first, char *buf, int size);
+int trace_set_buffer(char *packet);
+
+int trace_select_frame(char *packet, char *buf, int size);
+int trace_frame_selected();
+int trace_frame_reg(int reg, uint32_t *value);
+int trace_frame_mem(uint32_t addr, int len, uint8_t *dest);
+
+#endif